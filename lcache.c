@@ -0,0 +1,240 @@
+#include <linux/bitmap.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "lcache.h"
+
+static const uint64_t LCACHE_MAGIC = 0x31454843414c5a4fULL;  // "OZLACHE1"
+static const uint32_t LCACHE_VERSION = 1;
+static const size_t LCACHE_CHUNK = 64 * 1024;
+// chunks fetched from remote by one read at most
+static const size_t LCACHE_FETCH_MAX = 16;
+// chunks fetched between write backs of the bitmap, 16 MiB
+static const int LCACHE_SYNC_CHUNKS = 256;
+
+static ssize_t lcache_file_read(struct file *file, void *buf, size_t count,
+                                loff_t pos) {
+    ssize_t ret, sret = 0;
+
+    while (count > 0) {
+        ret = kernel_read(file, buf, count, &pos);
+        if (ret <= 0) return sret ? sret : ret;
+        count -= ret;
+        buf += ret;
+        sret += ret;
+    }
+    return sret;
+}
+
+static ssize_t lcache_file_write(struct file *file, const void *buf,
+                                 size_t count, loff_t pos) {
+    ssize_t ret, sret = 0;
+
+    while (count > 0) {
+        ret = kernel_write(file, buf, count, &pos);
+        if (ret <= 0) return sret ? sret : ret;
+        count -= ret;
+        buf += ret;
+        sret += ret;
+    }
+    return sret;
+}
+
+static size_t lcache_bitmap_bytes(struct lcache *lc) {
+    return PAGE_ALIGN(BITS_TO_LONGS(lc->nr_chunks) * sizeof(unsigned long));
+}
+
+static int lcache_write_header(struct lcache *lc) {
+    ssize_t ret;
+
+    ret = lcache_file_write(lc->local, &lc->ht, sizeof(lc->ht), 0);
+    if (ret != sizeof(lc->ht)) return -EIO;
+    return vfs_fsync(lc->local, 0);
+}
+
+// load the bitmap of a cache file for the same remote file, or start over
+// with an empty one, written before the header claims it
+static int lcache_load(struct lcache *lc) {
+    size_t bytes = lcache_bitmap_bytes(lc);
+    struct lcache_ht ht;
+    ssize_t ret;
+
+    ret = lcache_file_read(lc->local, &ht, sizeof(ht), 0);
+    if (ret == sizeof(ht) && ht.magic == lc->ht.magic &&
+        ht.version == lc->ht.version && ht.chunk_size == lc->ht.chunk_size &&
+        ht.remote_size == lc->ht.remote_size &&
+        ht.remote_mtime == lc->ht.remote_mtime &&
+        ht.bitmap_offset == lc->ht.bitmap_offset &&
+        ht.data_offset == lc->ht.data_offset && ht.clean) {
+        ret = lcache_file_read(lc->local, lc->bitmap, bytes,
+                               lc->ht.bitmap_offset);
+        if (ret == bytes) goto out;
+        pr_info("lcache: failed to read bitmap, start over\n");
+        bitmap_zero(lc->bitmap, lc->nr_chunks);
+    } else {
+        pr_info("lcache: cache file stale or not closed, start over\n");
+    }
+    ret = lcache_file_write(lc->local, lc->bitmap, bytes,
+                            lc->ht.bitmap_offset);
+    if (ret != bytes) return -EIO;
+out:
+    lc->ht.clean = 1;
+    return lcache_write_header(lc);
+}
+
+// write the bitmap back, claiming only chunks synced to local file. bits set
+// after the copy is taken wait for the next write back
+static int lcache_sync(struct lcache *lc) {
+    size_t bytes = lcache_bitmap_bytes(lc);
+    ssize_t ret;
+    int err;
+
+    memcpy(lc->synced, lc->bitmap, bytes);
+    err = vfs_fsync(lc->local, 0);
+    if (err) return err;
+    ret = lcache_file_write(lc->local, lc->synced, bytes,
+                            lc->ht.bitmap_offset);
+    return ret == bytes ? 0 : -EIO;
+}
+
+struct lcache *lcache_open(const char *path, struct file *remote,
+                           loff_t max_size) {
+    struct inode *inode = file_inode(remote);
+    struct lcache *lc;
+
+    lc = kzalloc(sizeof(*lc), GFP_KERNEL);
+    if (!lc) return NULL;
+    lc->remote = remote;
+    lc->nr_chunks = DIV_ROUND_UP(i_size_read(inode), LCACHE_CHUNK);
+    lc->ht.magic = LCACHE_MAGIC;
+    lc->ht.version = LCACHE_VERSION;
+    lc->ht.chunk_size = LCACHE_CHUNK;
+    lc->ht.remote_size = i_size_read(inode);
+    lc->ht.remote_mtime = inode->i_mtime.tv_sec;
+    lc->ht.bitmap_offset = PAGE_SIZE;
+    lc->ht.data_offset = PAGE_SIZE + lcache_bitmap_bytes(lc);
+    if (lc->ht.data_offset + lc->ht.remote_size > max_size) {
+        pr_info("lcache: %s would exceed %lld bytes\n", path, max_size);
+        goto fail_free;
+    }
+
+    lc->local = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if (IS_ERR(lc->local)) {
+        pr_info("lcache: cannot open %s, %ld\n", path, PTR_ERR(lc->local));
+        goto fail_free;
+    }
+    lc->bitmap = vzalloc(lcache_bitmap_bytes(lc));
+    lc->synced = vmalloc(lcache_bitmap_bytes(lc));
+    if (!lc->bitmap || !lc->synced) goto fail_close;
+    mutex_init(&lc->sync_lock);
+    atomic_set(&lc->fetched, 0);
+    if (lcache_load(lc)) {
+        pr_info("lcache: failed to write header of %s\n", path);
+        goto fail_close;
+    }
+    pr_info("lcache: %s caches %u/%zu chunks\n", path,
+            bitmap_weight(lc->bitmap, lc->nr_chunks), lc->nr_chunks);
+    return lc;
+
+fail_close:
+    vfree(lc->synced);
+    vfree(lc->bitmap);
+    filp_close(lc->local, NULL);
+fail_free:
+    kfree(lc);
+    return NULL;
+}
+
+void lcache_close(struct lcache *lc) {
+    int err;
+
+    if (!lc) return;
+    mutex_lock(&lc->sync_lock);
+    err = lcache_sync(lc);
+    mutex_unlock(&lc->sync_lock);
+    if (err) pr_info("lcache: failed to write bitmap, %d\n", err);
+    filp_close(lc->local, NULL);
+    vfree(lc->synced);
+    vfree(lc->bitmap);
+    kfree(lc);
+}
+
+// fetch chunks [first, last) from remote into local file, and copy
+// [pos, pos + count) within them to `buf`, through `bounce` if they are not
+// all wanted
+static int lcache_fetch(struct lcache *lc, void *buf, loff_t pos,
+                        size_t count, size_t first, size_t last, void *bounce,
+                        size_t bounce_size) {
+    loff_t begin = (loff_t)first * LCACHE_CHUNK;
+    size_t len =
+        min_t(loff_t, (loff_t)last * LCACHE_CHUNK, lc->ht.remote_size) - begin;
+    ssize_t ret;
+    size_t i;
+
+    if (pos == begin && count == len) {
+        bounce = buf;
+    } else if (len > bounce_size) {
+        // no room for a whole chunk, served from remote but not kept
+        ret = lcache_file_read(lc->remote, buf, count, pos);
+        return ret == count ? 0 : -EIO;
+    }
+    ret = lcache_file_read(lc->remote, bounce, len, begin);
+    if (ret != len) {
+        pr_info("lcache: remote read at %lld failed, %ld\n", begin, ret);
+        return -EIO;
+    }
+    ret = lcache_file_write(lc->local, bounce, len, lc->ht.data_offset + begin);
+    if (ret == len) {
+        for (i = first; i < last; i++) set_bit(i, lc->bitmap);
+    } else {
+        // served from remote anyway, just not kept
+        pr_info("lcache: local write at %lld failed, %ld\n", begin, ret);
+    }
+    if (bounce != buf) memcpy(buf, bounce + (pos - begin), count);
+
+    // one reader writes the bitmap back, others go on
+    if (atomic_add_return(last - first, &lc->fetched) >= LCACHE_SYNC_CHUNKS &&
+        mutex_trylock(&lc->sync_lock)) {
+        atomic_set(&lc->fetched, 0);
+        if (lcache_sync(lc)) pr_info("lcache: failed to write bitmap\n");
+        mutex_unlock(&lc->sync_lock);
+    }
+    return 0;
+}
+
+ssize_t lcache_read(struct lcache *lc, void *buf, size_t count, loff_t pos,
+                    void *bounce, size_t bounce_size) {
+    loff_t end = min_t(loff_t, pos + count, lc->ht.remote_size);
+    size_t fetch_max = clamp_t(size_t, bounce_size / LCACHE_CHUNK, 1,
+                               LCACHE_FETCH_MAX);
+    ssize_t ret = 0, cnt;
+    size_t k, n, len;
+    bool present;
+
+    while (pos < end) {
+        k = pos / LCACHE_CHUNK;
+        present = test_bit(k, lc->bitmap);
+        // run of chunks in the same state, misses are fetched in one read
+        for (n = k + 1; (loff_t)n * LCACHE_CHUNK < end &&
+                        !!test_bit(n, lc->bitmap) == present &&
+                        (present || n - k < fetch_max);
+             n++)
+            ;
+        len = min_t(loff_t, (loff_t)n * LCACHE_CHUNK, end) - pos;
+        if (present) {
+            cnt = lcache_file_read(lc->local, buf, len,
+                                   lc->ht.data_offset + pos);
+            if (cnt != len) return -EIO;
+        } else {
+            cnt = lcache_fetch(lc, buf, pos, len, k, n, bounce, bounce_size);
+            if (cnt) return cnt;
+        }
+        buf += len;
+        pos += len;
+        ret += len;
+    }
+    return ret;
+}
@@ -0,0 +1,49 @@
+#ifndef __LCACHE_H__
+#define __LCACHE_H__
+
+#include <linux/fs.h>
+#include <linux/mutex.h>
+
+// on-disk header of a local cache file, at offset 0
+struct lcache_ht {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t clean;        // bitmap on disk claims only synced data
+    uint64_t chunk_size;   // bytes of remote file a bitmap bit stands for
+    uint64_t remote_size;  // identity of the remote file cached
+    int64_t remote_mtime;
+    uint64_t bitmap_offset;
+    uint64_t data_offset;  // remote byte `x` is kept at `data_offset + x`
+};
+
+// local persistent cache of a remote (slow) back file, kept in a sparse file
+// on local storage. remote data is mirrored chunk by chunk, a bitmap tells
+// which chunks are present. the bitmap is written back every
+// `LCACHE_SYNC_CHUNKS` chunks fetched and at close, each time after the data
+// it claims is synced, so after a crash only chunks fetched since the last
+// write back are fetched again
+struct lcache {
+    struct file* local;
+    struct file* remote;
+    struct lcache_ht ht;
+    unsigned long* bitmap;
+    unsigned long* synced;  // copy of `bitmap` being written back
+    size_t nr_chunks;
+    atomic_t fetched;       // chunks fetched since the last write back
+    struct mutex sync_lock;
+};
+
+// open or create cache file at `path` for `remote`, refusing to grow it
+// beyond `max_size` bytes. returns NULL if the cache can not be used
+struct lcache* lcache_open(const char* path, struct file* remote,
+                           loff_t max_size);
+void lcache_close(struct lcache* lc);
+
+// read [pos, pos + count) of remote file, from local file where present,
+// fetching missing chunks from remote and keeping them locally. chunks only
+// partly wanted are fetched whole into `bounce` of `bounce_size` bytes, a
+// scratch buffer of the caller
+ssize_t lcache_read(struct lcache* lc, void* buf, size_t count, loff_t pos,
+                    void* bounce, size_t bounce_size);
+
+#endif
@@ -2,19 +2,48 @@
 #include <linux/fs.h>
 //#include <asm/uaccess.h>
 #include <linux/buffer_head.h>
+#include <linux/ktime.h>
 #include <linux/lz4.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
 #include <linux/slab.h>
+#include <linux/uio.h>
 #include <linux/vmalloc.h>
 
 #include "lsmt.h"
+#include "vbd_trace.h"
 #include "zfile.h"
 
+#define LSMT_MERGE_MAX 16
+
 static const uint64_t INVALID_OFFSET = (1UL << 50) - 1;
 static const uint32_t HT_SPACE = 4096;
 static uint64_t *MAGIC0 = (uint64_t *)"LSMT\0\1\2";
 static const uuid_t MAGIC1 = UUID_INIT(0x657e63d2, 0x9444, 0x084c, 0xa2, 0xd2,
                                        0xc8, 0xec, 0x4f, 0xcf, 0xae, 0x8a);
 
+static unsigned int merge_gap = 64 * 1024;
+module_param(merge_gap, uint, 0644);
+MODULE_PARM_DESC(merge_gap,
+                 "Max gap in bytes between data segments in underlay to merge "
+                 "them into one read");
+
+static bool compact_index;
+module_param(compact_index, bool, 0444);
+MODULE_PARM_DESC(compact_index,
+                 "Keep segment index varint encoded in memory, smaller but "
+                 "slower to look up");
+
+static bool lazy_index;
+module_param(lazy_index, bool, 0444);
+MODULE_PARM_DESC(lazy_index,
+                 "Read segment index pages when first looked up, instead of "
+                 "the whole index at open");
+
+// opened lsmt files, shared by all opening the same zfile
+static LIST_HEAD(lsmt_layers);
+static DEFINE_MUTEX(lsmt_layers_lock);
+
 static uint64_t segment_end(const struct segment_mapping *s) {
     return s->offset + s->length;
 }
@@ -42,11 +71,10 @@ static void trim_edge(struct segment_mapping *pm, size_t m,
         backward_end_to(back, segment_end(s));
 }
 
-const struct segment_mapping *ro_index_lower_bound(
-    const struct lsmt_ro_index *index, uint64_t offset) {
+static size_t ro_index_bsearch(const struct lsmt_ro_index *index,
+                               uint64_t offset) {
     const struct segment_mapping *l = index->pbegin;
     const struct segment_mapping *r = index->pend - 1;
-    const struct segment_mapping *pret;
     int ret = -1;
     while (l <= r) {
         int m = ((l - index->pbegin) + (r - index->pbegin)) >> 1;
@@ -58,7 +86,41 @@ const struct segment_mapping *ro_index_lower_bound(
             r = index->pbegin + (m - 1);
         }
     }
-    pret = index->pbegin + (ret + 1);
+    return ret + 1;
+}
+
+// descend the tree from the root, each level costs one cache line and a
+// branch-free count of keys not greater than `offset`
+static size_t ro_index_tree_search(const struct lsmt_ro_index *index,
+                                   uint64_t offset) {
+    size_t n = index->pend - index->pbegin;
+    size_t node = 0;
+    size_t j;
+    int h, k;
+
+    // all segments end before `offset`, the last key of the root. past
+    // this check every node holds a key greater than `offset`, so `j`
+    // stays below LSMT_BTREE_B and the leaf found is a real segment
+    if (offset >= segment_end(index->pend - 1)) return n;
+    for (h = index->height - 1; h >= 0; h--) {
+        const uint64_t *keys =
+            index->tree + index->level_off[h] + node * LSMT_BTREE_B;
+        j = 0;
+        for (k = 0; k < LSMT_BTREE_B; k++) j += keys[k] <= offset;
+        node = node * LSMT_BTREE_B + j;
+    }
+    return node;
+}
+
+// first segment ends after `offset`
+const struct segment_mapping *ro_index_lower_bound(
+    const struct lsmt_ro_index *index, uint64_t offset) {
+    const struct segment_mapping *pret;
+
+    if (index->tree)
+        pret = index->pbegin + ro_index_tree_search(index, offset);
+    else
+        pret = index->pbegin + ro_index_bsearch(index, offset);
     if (pret >= index->pend) {
         return index->pend;
     } else {
@@ -66,30 +128,380 @@ const struct segment_mapping *ro_index_lower_bound(
     }
 }
 
+static void ro_index_build(struct lsmt_ro_index *index) {
+    size_t n = index->pend - index->pbegin;
+    size_t nodes[LSMT_BTREE_MAX_HEIGHT];
+    size_t total = 0;
+    size_t i, k;
+    uint64_t *level;
+    int h = 0;
+
+    index->tree = NULL;
+    index->height = 0;
+    if (n == 0) return;
+
+    nodes[0] = DIV_ROUND_UP(n, LSMT_BTREE_B);
+    while (nodes[h] > 1) {
+        if (h + 1 == LSMT_BTREE_MAX_HEIGHT) return;
+        nodes[h + 1] = DIV_ROUND_UP(nodes[h], LSMT_BTREE_B);
+        h++;
+    }
+    for (k = 0; k <= h; k++) {
+        index->level_off[k] = total;
+        total += nodes[k] * LSMT_BTREE_B;
+    }
+    index->tree = vmalloc(total * sizeof(uint64_t));
+    if (!index->tree) {
+        pr_info("LSMT: no memory for index tree, use binary search\n");
+        return;
+    }
+    index->height = h + 1;
+
+    level = index->tree;
+    for (i = 0; i < nodes[0] * LSMT_BTREE_B; i++)
+        level[i] = i < n ? segment_end(index->pbegin + i) : U64_MAX;
+    for (k = 1; k <= h; k++) {
+        const uint64_t *child = index->tree + index->level_off[k - 1];
+
+        level = index->tree + index->level_off[k];
+        for (i = 0; i < nodes[k] * LSMT_BTREE_B; i++)
+            level[i] = i < nodes[k - 1]
+                           ? child[i * LSMT_BTREE_B + LSMT_BTREE_B - 1]
+                           : U64_MAX;
+    }
+}
+
+static size_t put_varint(uint8_t *p, uint64_t v) {
+    size_t n = 0;
+
+    do {
+        if (p) p[n] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+        v >>= 7;
+        n++;
+    } while (v);
+    return n;
+}
+
+static uint64_t get_varint(const uint8_t **p) {
+    uint64_t v = 0;
+    int shift = 0;
+
+    do {
+        v |= (uint64_t)(**p & 0x7f) << shift;
+        shift += 7;
+    } while (*(*p)++ & 0x80);
+    return v;
+}
+
+// encode segments `s[0..n)` of a block into `p`, or just size them if
+// `p` is NULL. returns bytes taken
+static size_t ro_index_encode(const struct segment_mapping *s, size_t n,
+                              uint8_t *p) {
+    uint64_t end = s[0].offset, mend = s[0].moffset;
+    int64_t delta;
+    size_t i, len = 0;
+
+    for (i = 0; i < n; i++) {
+        len += put_varint(p ? p + len : NULL, s[i].offset - end);
+        len += put_varint(p ? p + len : NULL,
+                          (uint64_t)s[i].length << 1 | s[i].zeroed);
+        end = segment_end(&s[i]);
+        if (s[i].zeroed) continue;
+        delta = (int64_t)s[i].moffset - (int64_t)mend;
+        len += put_varint(p ? p + len : NULL, (delta << 1) ^ (delta >> 63));
+        mend = s[i].moffset + s[i].length;
+    }
+    return len;
+}
+
+// replace the segments of `index` by its compact form, keeps them if no
+// memory
+static void ro_index_compact(struct lsmt_ro_index *index) {
+    size_t n = index->nr;
+    size_t b, cnt, size = 0;
+    const struct segment_mapping *first;
+
+    index->skip = NULL;
+    index->data = NULL;
+    index->nr_blocks = DIV_ROUND_UP(n, LSMT_CBLOCK);
+    if (n == 0) return;
+    for (b = 0; b < index->nr_blocks; b++)
+        size += ro_index_encode(index->pbegin + b * LSMT_CBLOCK,
+                                min_t(size_t, LSMT_CBLOCK, n - b * LSMT_CBLOCK),
+                                NULL);
+    if (size > U32_MAX) return;
+    index->skip = vmalloc(index->nr_blocks * sizeof(struct lsmt_skip));
+    index->data = vmalloc(size);
+    if (!index->skip || !index->data) {
+        pr_info("LSMT: no memory for compact index, keep it flat\n");
+        vfree(index->skip);
+        vfree(index->data);
+        index->skip = NULL;
+        index->data = NULL;
+        return;
+    }
+    size = 0;
+    for (b = 0; b < index->nr_blocks; b++) {
+        first = index->pbegin + b * LSMT_CBLOCK;
+        cnt = min_t(size_t, LSMT_CBLOCK, n - b * LSMT_CBLOCK);
+        index->skip[b].offset = first->offset;
+        index->skip[b].moffset = first->moffset;
+        index->skip[b].pos = size;
+        size += ro_index_encode(first, cnt, index->data + size);
+    }
+    index->data_size = size;
+}
+
+static void ro_index_load_block(struct lsmt_cursor *cur, size_t b) {
+    const struct lsmt_ro_index *index = cur->index;
+
+    cur->blk = b;
+    cur->left = min_t(size_t, LSMT_CBLOCK, index->nr - b * LSMT_CBLOCK);
+    cur->p = index->data + index->skip[b].pos;
+    cur->end = index->skip[b].offset;
+    cur->mend = index->skip[b].moffset;
+}
+
+// page `k` of a lazy index, read and published by whoever needs it first.
+// NULL if it can not be read
+static struct lsmt_ipage *ro_index_page(const struct lsmt_ro_index *index,
+                                        size_t k) {
+    struct lsmt_ipage *pg = smp_load_acquire(&index->pages[k]), *old;
+    size_t cnt, i;
+    ssize_t ret;
+
+    if (pg) return pg;
+    cnt = min_t(size_t, LSMT_IPAGE, index->index_size - k * LSMT_IPAGE);
+    pg = kvmalloc(struct_size(pg, m, cnt), GFP_NOIO);
+    if (!pg) return NULL;
+    ret = zfile_read(index->fp, pg->m, cnt * sizeof(struct segment_mapping),
+                     index->index_offset +
+                         k * LSMT_IPAGE * sizeof(struct segment_mapping));
+    if (ret != cnt * sizeof(struct segment_mapping)) {
+        pr_info("LSMT: failed to read index page %zu, ret=%ld\n", k, ret);
+        kvfree(pg);
+        return NULL;
+    }
+    pg->nr = 0;
+    for (i = 0; i < cnt; i++) {
+        if (pg->m[i].offset != INVALID_OFFSET) {
+            if (pg->nr != i) break;
+            pg->m[pg->nr].tag = 0;
+            pg->nr++;
+        }
+    }
+    // invalid segments sort last, and pages of them only are left out of
+    // the table at open, the page search relies on both
+    if (WARN_ONCE(!pg->nr || i < cnt, "LSMT: index page %zu out of order\n",
+                  k)) {
+        kvfree(pg);
+        return NULL;
+    }
+    pg->last_end = segment_end(&pg->m[pg->nr - 1]);
+    old = cmpxchg(&index->pages[k], NULL, pg);
+    if (old) {
+        kvfree(pg);
+        return old;
+    }
+    return pg;
+}
+
+// number of leading index pages holding valid segments, searched by the
+// first segment of each page as invalid segments sort last. pages after
+// them are dropped from the table, the last segment on disk must then be
+// invalid too
+static int ro_index_count_pages(struct lsmt_ro_index *index) {
+    struct segment_mapping m;
+    size_t l = 0, r = DIV_ROUND_UP(index->index_size, LSMT_IPAGE), n, k;
+    ssize_t ret;
+
+    n = r;
+    while (l < r) {
+        k = (l + r) / 2;
+        ret = zfile_read(index->fp, &m, sizeof(m),
+                         index->index_offset + k * LSMT_IPAGE * sizeof(m));
+        if (ret != sizeof(m)) return -EIO;
+        if (m.offset == INVALID_OFFSET)
+            r = k;
+        else
+            l = k + 1;
+    }
+    if (l < n) {
+        ret = zfile_read(index->fp, &m, sizeof(m),
+                         index->index_offset +
+                             (index->index_size - 1) * sizeof(m));
+        if (ret != sizeof(m)) return -EIO;
+        if (WARN_ONCE(m.offset != INVALID_OFFSET,
+                      "LSMT: index page %zu empty but not last\n", l))
+            return -EIO;
+    }
+    index->nr_pages = l;
+    return 0;
+}
+
+// page `k` of the index of `cur`, which is only looked at if `cur->nowait`.
+// sets `cur->err` if there is none
+static struct lsmt_ipage *ro_index_cur_page(struct lsmt_cursor *cur,
+                                            size_t k) {
+    struct lsmt_ipage *pg;
+
+    if (cur->nowait)
+        pg = smp_load_acquire(&cur->index->pages[k]);
+    else
+        pg = ro_index_page(cur->index, k);
+    if (!pg) cur->err = cur->nowait ? -EAGAIN : -EIO;
+    return pg;
+}
+
+// move `cur` on to the next page while it is past its page
+static const struct segment_mapping *ro_index_page_fix(
+    struct lsmt_cursor *cur) {
+    const struct lsmt_ro_index *index = cur->index;
+    struct lsmt_ipage *pg;
+
+    while (cur->it == cur->pend) {
+        if (cur->page + 1 >= index->nr_pages) return NULL;
+        pg = ro_index_cur_page(cur, ++cur->page);
+        if (!pg) return NULL;
+        cur->it = pg->m;
+        cur->pend = pg->m + pg->nr;
+    }
+    return cur->it;
+}
+
+// segment after the one at `cur`, NULL at the end of index
+const struct segment_mapping *ro_index_next(struct lsmt_cursor *cur) {
+    const struct lsmt_ro_index *index = cur->index;
+    struct segment_mapping *m = &cur->m;
+    uint64_t v;
+
+    if (index->pages) {
+        if (cur->it == cur->pend) return NULL;
+        cur->it++;
+        return ro_index_page_fix(cur);
+    }
+    if (!index->skip) {
+        if (cur->it == index->pend || ++cur->it == index->pend) return NULL;
+        return cur->it;
+    }
+    if (cur->left == 0) {
+        if (cur->blk + 1 >= index->nr_blocks) return NULL;
+        ro_index_load_block(cur, cur->blk + 1);
+    }
+    cur->left--;
+    m->offset = cur->end + get_varint(&cur->p);
+    v = get_varint(&cur->p);
+    m->length = v >> 1;
+    m->zeroed = v & 1;
+    m->tag = 0;
+    m->moffset = 0;
+    cur->end = m->offset + m->length;
+    if (!m->zeroed) {
+        v = get_varint(&cur->p);
+        m->moffset = cur->mend + (int64_t)((v >> 1) ^ -(v & 1));
+        cur->mend = m->moffset + m->length;
+    }
+    return m;
+}
+
+// see `__ro_index_seek`
+static const struct segment_mapping *ro_index_search(
+    const struct lsmt_ro_index *index, uint64_t offset,
+    struct lsmt_cursor *cur, bool nowait) {
+    const struct segment_mapping *it;
+    struct lsmt_ipage *pg;
+    size_t l = 0, r = index->nr_blocks, m;
+
+    cur->index = index;
+    cur->err = 0;
+    cur->nowait = nowait;
+    if (index->pages) {
+        // first page with a segment ending after `offset`, loading pages
+        // the search goes through
+        r = index->nr_pages;
+        while (l < r) {
+            m = (l + r) / 2;
+            pg = ro_index_cur_page(cur, m);
+            if (!pg) return NULL;
+            if (pg->last_end <= offset)
+                l = m + 1;
+            else
+                r = m;
+        }
+        if (l == index->nr_pages) return NULL;
+        pg = ro_index_cur_page(cur, l);
+        if (!pg) return NULL;
+        cur->page = l;
+        cur->pend = pg->m + pg->nr;
+        for (cur->it = pg->m; cur->it < cur->pend; cur->it++)
+            if (segment_end(cur->it) > offset) break;
+        return ro_index_page_fix(cur);
+    }
+    if (!index->skip) {
+        cur->it = ro_index_lower_bound(index, offset);
+        return cur->it == index->pend ? NULL : cur->it;
+    }
+    // last block starting at or before `offset`, segments of blocks before
+    // it all end before it
+    while (l < r) {
+        m = (l + r) / 2;
+        if (index->skip[m].offset <= offset)
+            l = m + 1;
+        else
+            r = m;
+    }
+    ro_index_load_block(cur, l ? l - 1 : 0);
+    do {
+        it = ro_index_next(cur);
+    } while (it && segment_end(it) <= offset);
+    return it;
+}
+
+// position `cur` at the first segment ending after `offset`, and return
+// it, or NULL if there is none. with `nowait`, pages of a lazy index not
+// loaded yet fail the search with -EAGAIN instead of being read. every
+// index walk starts here, so here it is traced
+static const struct segment_mapping *__ro_index_seek(
+    const struct lsmt_ro_index *index, uint64_t offset,
+    struct lsmt_cursor *cur, bool nowait) {
+    const struct segment_mapping *it = ro_index_search(index, offset, cur,
+                                                       nowait);
+
+    trace_vbd_index_lookup(offset, it ? it->offset : 0, it ? it->length : 0,
+                           it ? it->moffset : 0, cur->err);
+    return it;
+}
+
+const struct segment_mapping *ro_index_seek(const struct lsmt_ro_index *index,
+                                            uint64_t offset,
+                                            struct lsmt_cursor *cur) {
+    return __ro_index_seek(index, offset, cur, false);
+}
+
 int ro_index_lookup(const struct lsmt_ro_index *index,
                     const struct segment_mapping *query_segment,
                     struct segment_mapping *ret_mappings, size_t n) {
     int cnt = 0;
-    const struct segment_mapping *lb;
+    struct lsmt_cursor cur;
     const struct segment_mapping *it;
 
     if (query_segment->length == 0) return 0;
-    lb = ro_index_lower_bound(index, query_segment->offset);
-    for (it = lb; it != index->pend; it++) {
+    for (it = ro_index_seek(index, query_segment->offset, &cur); it;
+         it = ro_index_next(&cur)) {
         if (it->offset >= segment_end(query_segment)) break;
         ret_mappings[cnt++] = *it;
         if (cnt == n) break;
     }
-    if (cnt == 0) return 0;
-    trim_edge(ret_mappings, cnt, query_segment);
+    if (cur.err) cnt = 0;
+    if (cnt) trim_edge(ret_mappings, cnt, query_segment);
     return cnt;
 }
 
-size_t ro_index_size(const struct lsmt_ro_index *index) {
-    return index->pend - index->pbegin;
-}
+size_t ro_index_size(const struct lsmt_ro_index *index) { return index->nr; }
 
-struct lsmt_file *lsmt_open(struct zfile *fp) {
+static void lsmt_free(struct lsmt_file *fp);
+
+static struct lsmt_file *lsmt_open_layer(struct zfile *fp) {
     unsigned int ret;
     struct segment_mapping *p = NULL;
     struct lsmt_file *lf = NULL;
@@ -106,11 +518,18 @@ struct lsmt_file *lsmt_open(struct zfile *fp) {
 
     if (!is_lsmtfile(fp)) {
         pr_info("LSMT: fp is not a lsmtfile\n");
+        zfile_close(fp);
         return NULL;
     }
 
     lf = kzalloc(sizeof(struct lsmt_file), GFP_KERNEL);
+    if (!lf) {
+        zfile_close(fp);
+        return NULL;
+    }
     lf->fp = fp;
+    kref_init(&lf->ref);
+    INIT_LIST_HEAD(&lf->layer);
 
     file_size = zfile_len(fp);
     tailer_offset = file_size - HT_SPACE;
@@ -118,15 +537,28 @@ struct lsmt_file *lsmt_open(struct zfile *fp) {
     ret = zfile_read(fp, &lf->ht, sizeof(struct lsmt_ht), tailer_offset);
     if (ret < (ssize_t)sizeof(struct lsmt_ht)) {
         printk("failed to load tailer \n");
-        return NULL;
+        goto fail;
     }
     pr_info("LSMT: index off: %lld cnt: %lld\n", lf->ht.index_offset,
             lf->ht.index_size);
 
     index_bytes = lf->ht.index_size * sizeof(struct segment_mapping);
     pr_info("LSMT: off: %lld, bytes: %ld\n", lf->ht.index_offset, index_bytes);
-    if (index_bytes == 0 || index_bytes > 1024UL * 1024 * 1024) return NULL;
+    if (index_bytes == 0 || index_bytes > 1024UL * 1024 * 1024) goto fail;
+    if (lazy_index) {
+        lf->index.fp = fp;
+        lf->index.index_offset = lf->ht.index_offset;
+        lf->index.index_size = lf->ht.index_size;
+        if (ro_index_count_pages(&lf->index)) goto fail;
+        lf->index.pages =
+            vzalloc(max_t(size_t, lf->index.nr_pages, 1) *
+                    sizeof(struct lsmt_ipage *));
+        if (!lf->index.pages) goto fail;
+        pr_info("LSMT: lazy index of %lu pages\n", lf->index.nr_pages);
+        return lf;
+    }
     p = vmalloc(index_bytes);
+    if (!p) goto fail;
     pr_info("LSMT: loadindex off: %lld cnt: %ld\n", lf->ht.index_offset,
             index_bytes);
     ret = zfile_read(fp, p, index_bytes, lf->ht.index_offset);
@@ -134,7 +566,7 @@ struct lsmt_file *lsmt_open(struct zfile *fp) {
     if (ret < index_bytes) {
         printk("failed to read index\n");
         vfree(p);
-        return NULL;
+        goto fail;
     }
     for (idx = 0; idx < lf->ht.index_size; idx++) {
         if (p[idx].offset != INVALID_OFFSET) {
@@ -147,16 +579,84 @@ struct lsmt_file *lsmt_open(struct zfile *fp) {
     lf->index.mapping = p;
     lf->index.pbegin = p;
     lf->index.pend = p + cnt;
+    lf->index.nr = cnt;
+    if (compact_index) {
+        ro_index_compact(&lf->index);
+        if (lf->index.skip) {
+            pr_info("LSMT: compact index %lu bytes for %llu segments\n",
+                    lf->index.data_size, cnt);
+            vfree(p);
+            lf->index.mapping = NULL;
+            lf->index.pbegin = lf->index.pend = NULL;
+            return lf;
+        }
+    }
+    ro_index_build(&lf->index);
     return lf;
+
+fail:
+    // takes the reference of `fp` along
+    lsmt_free(lf);
+    return NULL;
 }
 
-void lsmt_close(struct lsmt_file *fp) {
+struct lsmt_file *lsmt_open(struct zfile *fp) {
+    struct lsmt_file *lf;
+
+    mutex_lock(&lsmt_layers_lock);
+    list_for_each_entry(lf, &lsmt_layers, layer) {
+        if (lf->fp == fp) {
+            kref_get(&lf->ref);
+            mutex_unlock(&lsmt_layers_lock);
+            // the opened layer holds its own reference of `fp`
+            zfile_close(fp);
+            return lf;
+        }
+    }
+    lf = lsmt_open_layer(fp);
+    if (lf) list_add(&lf->layer, &lsmt_layers);
+    mutex_unlock(&lsmt_layers_lock);
+    return lf;
+}
+
+static void lsmt_free(struct lsmt_file *fp) {
+    size_t i;
+
     // TODO: dealloc
     zfile_close(fp->fp);
+    vfree(fp->index.tree);
     vfree(fp->index.mapping);
+    vfree(fp->index.skip);
+    vfree(fp->index.data);
+    if (fp->index.pages) {
+        for (i = 0; i < fp->index.nr_pages; i++) kvfree(fp->index.pages[i]);
+    }
+    vfree(fp->index.pages);
     kfree(fp);
 }
 
+// called with `lsmt_layers_lock` held by `kref_put_mutex`
+static void lsmt_release(struct kref *ref) {
+    struct lsmt_file *fp = container_of(ref, struct lsmt_file, ref);
+
+    list_del(&fp->layer);
+    mutex_unlock(&lsmt_layers_lock);
+    lsmt_free(fp);
+}
+
+void lsmt_close(struct lsmt_file *fp) {
+    kref_put_mutex(&fp->ref, lsmt_release, &lsmt_layers_lock);
+}
+
+int lsmt_warm(struct lsmt_file *fp) {
+    size_t i;
+
+    for (i = 0; i < fp->index.nr_pages; i++) {
+        if (!ro_index_page(&fp->index, i)) return -EIO;
+    }
+    return zfile_warm(fp->fp);
+}
+
 struct path lsmt_getpath(struct lsmt_file *file) {
     return zfile_getpath(file->fp);
 }
@@ -164,70 +664,207 @@ struct path lsmt_getpath(struct lsmt_file *file) {
 struct file *lsmt_getfile(struct lsmt_file *file) {
     return zfile_getfile(file->fp);
 }
+
+struct zfile *lsmt_getzfile(struct lsmt_file *file) { return file->fp; }
 static bool is_aligned(uint64_t val) { return 0 == (val & 0x1FFUL); }
 
-ssize_t lsmt_read(struct lsmt_file *fp, void *buf, size_t count,
-                  loff_t offset) {
-    // TODO: read from underlay
-    struct segment_mapping s;
-    struct segment_mapping *m;
+// read a run of data extents with a single zfile read, or out of block
+// cache only if `nowait`, adding blocks copied to `*hits` then
+static ssize_t lsmt_read_run(struct lsmt_file *fp, struct iov_iter *to,
+                             const struct zfile_extent *ext, int n,
+                             bool nowait, size_t *hits) {
+    size_t len = 0;
+    ssize_t dc;
+    int i;
+
+    if (n == 0) return 0;
+    if (nowait) {
+        for (i = 0; i < n; i++) {
+            dc = zfile_read_cached(fp->fp, to, ext[i].count, ext[i].offset,
+                                   hits);
+            if (dc != ext[i].count) return dc < 0 ? dc : -EIO;
+            len += dc;
+        }
+        return len;
+    }
+    for (i = 0; i < n; i++) len += ext[i].count;
+    dc = zfile_read_extents(fp->fp, to, ext, n);
+    if (dc != len) {
+        pr_info("LSMT: read failed ret=%ld\n", dc);
+        return dc < 0 ? dc : -EIO;
+    }
+    return dc;
+}
+
+// zero `len` bytes of `to` for holes and zeroed segments
+static ssize_t lsmt_read_zero(struct lsmt_file *fp, struct iov_iter *to,
+                              size_t len) {
+    if (len == 0) return 0;
+    if (iov_iter_zero(len, to) != len) return -EFAULT;
+    return len;
+}
+
+// see `lsmt_read_iter` and `lsmt_read_cached`
+static ssize_t __lsmt_read_iter(struct lsmt_file *fp, struct iov_iter *to,
+                                size_t count, loff_t offset, bool nowait) {
+    const struct segment_mapping *it;
+    struct lsmt_cursor cur;
+    struct zfile_extent run[LSMT_MERGE_MAX];
+    uint64_t pos, end, seg_begin, seg_end;
+    loff_t moffset, run_end = 0;
     ssize_t ret = 0;
-    size_t i = 0;
+    u64 start;
+    ssize_t dc;
+    size_t len, zlen = 0, zeroed = 0, hits = 0;
+    int n = 0;
+
     if (!is_aligned(offset | count)) {
         pr_info("LSMT: %lld %lu not aligned\n", offset, count);
         return -EINVAL;
     }
     if (offset > fp->ht.virtual_size) {
-        pr_info("LSMT: %lld over tail\n", offset);
+        pr_debug("LSMT: %lld over tail\n", offset);
         return 0;
     }
     if (offset + count > fp->ht.virtual_size) {
-        pr_info("LSMT: %lld %lu over tail\n", offset, count);
+        pr_debug("LSMT: %lld %lu over tail\n", offset, count);
         count = fp->ht.virtual_size - offset;
     }
-    m = kmalloc(16 * sizeof(struct segment_mapping), GFP_KERNEL);
-    s.offset = offset / SECTOR_SIZE;
-    s.length = count / SECTOR_SIZE;
-    while (true) {
-        int n = ro_index_lookup(&fp->index, &s, m, 16);
-        for (i = 0; i < n; ++i) {
-            if (s.offset < m[i].offset) {
-                // hole
-                memset(buf, 0, (m->offset - s.offset) * SECTOR_SIZE);
-                offset += (m[i].offset - s.offset) * SECTOR_SIZE;
-                buf += (m[i].offset - s.offset) * SECTOR_SIZE;
-                ret += (m[i].offset - s.offset) * SECTOR_SIZE;
-            }
-            // zeroe block
-            if (m[i].zeroed) {
-                memset(buf, 0, m->length * SECTOR_SIZE);
-                offset += m[i].length * SECTOR_SIZE;
-                buf += m[i].length * SECTOR_SIZE;
-                ret += m[i].length * SECTOR_SIZE;
-            } else {
-                ssize_t dc = zfile_read(fp->fp, buf, m->length * SECTOR_SIZE,
-                                        m->moffset * SECTOR_SIZE);
-                if (dc <= 0) {
-                    pr_info("LSMT: read failed ret=%ld\n", dc);
-                    goto out;
-                }
-                offset += m[i].length * SECTOR_SIZE;
-                buf += m[i].length * SECTOR_SIZE;
-                ret += m[i].length * SECTOR_SIZE;
-            }
-            forward_offset_to(&s, segment_end(&(m[i])));
+
+    // walk the index once for the whole range, in sectors. data segments
+    // next to each other in the underlay (up to `merge_gap` apart) are
+    // collected into a run, read by one fetch and one decompress pass
+    pos = offset / SECTOR_SIZE;
+    end = (offset + count) / SECTOR_SIZE;
+    start = ktime_get_ns();
+    it = __ro_index_seek(&fp->index, pos, &cur, nowait);
+    vbd_stat_time(&fp->fp->stats, VBD_LAT_INDEX, start);
+    for (; it && pos < end; it = ro_index_next(&cur)) {
+        if (it->offset >= end) break;
+        seg_begin = max_t(uint64_t, it->offset, pos);
+        seg_end = min_t(uint64_t, segment_end(it), end);
+        len = (seg_end - seg_begin) * SECTOR_SIZE;
+        moffset = (it->moffset + (seg_begin - it->offset)) * SECTOR_SIZE;
+        if (n > 0 && (pos < seg_begin || it->zeroed || n == LSMT_MERGE_MAX ||
+                      moffset < run_end || moffset - run_end > merge_gap)) {
+            dc = lsmt_read_run(fp, to, run, n, nowait, &hits);
+            if (dc < 0) return dc;
+            ret += dc;
+            n = 0;
         }
-        if (n < 16) break;
+        // holes and zeroed segments next to each other are zeroed at once
+        zlen += (seg_begin - pos) * SECTOR_SIZE;
+        if (it->zeroed) {
+            zlen += len;
+        } else {
+            dc = lsmt_read_zero(fp, to, zlen);
+            if (dc < 0) return dc;
+            ret += dc;
+            zeroed += dc;
+            zlen = 0;
+            run[n].offset = moffset;
+            run[n].count = len;
+            run_end = moffset + len;
+            n++;
+        }
+        pos = seg_end;
     }
-    if (s.length > 0) {
-        memset(buf, 0, s.length * SECTOR_SIZE);
-        offset += s.length * SECTOR_SIZE;
-        ret += s.length * SECTOR_SIZE;
-        buf += s.length * SECTOR_SIZE;
+    if (cur.err) return cur.err;
+    dc = lsmt_read_run(fp, to, run, n, nowait, &hits);
+    if (dc < 0) return dc;
+    ret += dc;
+    dc = lsmt_read_zero(fp, to, zlen + (end - pos) * SECTOR_SIZE);
+    if (dc < 0) return dc;
+    // counted only once all is served, a read given up with -EAGAIN is
+    // served again by the worker
+    vbd_stat_add(&fp->fp->stats, VBD_ZERO_BYTES, zeroed + dc);
+    vbd_stat_add(&fp->fp->stats, VBD_CACHE_HIT, hits);
+    return ret + dc;
+}
+
+ssize_t lsmt_read_iter(struct lsmt_file *fp, struct iov_iter *to,
+                       size_t count, loff_t offset) {
+    return __lsmt_read_iter(fp, to, count, offset, false);
+}
+
+ssize_t lsmt_read_cached(struct lsmt_file *fp, struct iov_iter *to,
+                         size_t count, loff_t offset) {
+    return __lsmt_read_iter(fp, to, count, offset, true);
+}
+
+ssize_t lsmt_read(struct lsmt_file *fp, void *buf, size_t count,
+                  loff_t offset) {
+    struct kvec kv = {.iov_base = buf, .iov_len = count};
+    struct iov_iter iter;
+
+    iov_iter_kvec(&iter, READ, &kv, 1, count);
+    return lsmt_read_iter(fp, &iter, count, offset);
+}
+
+bool lsmt_is_zero(struct lsmt_file *fp, size_t count, loff_t offset) {
+    const struct segment_mapping *it;
+    struct lsmt_cursor cur;
+    uint64_t end;
+
+    if (!is_aligned(offset | count) || count == 0 ||
+        offset + count > fp->ht.virtual_size)
+        return false;
+    end = (offset + count) / SECTOR_SIZE;
+    for (it = __ro_index_seek(&fp->index, offset / SECTOR_SIZE, &cur, true);
+         it && it->offset < end; it = ro_index_next(&cur)) {
+        if (!it->zeroed) return false;
     }
-out:
-    kfree(m);
-    return ret;
+    return cur.err == 0;
+}
+
+void lsmt_prefetch(struct lsmt_file *fp, size_t count, loff_t offset) {
+    const struct segment_mapping *it;
+    struct lsmt_cursor cur;
+    uint64_t pos, end, seg_begin, seg_end;
+    loff_t moffset, run_begin = 0, run_end = 0;
+
+    if (!is_aligned(offset | count) || offset >= fp->ht.virtual_size) return;
+    count = min_t(size_t, count, fp->ht.virtual_size - offset);
+    pos = offset / SECTOR_SIZE;
+    end = (offset + count) / SECTOR_SIZE;
+    // data segments contiguous in underlay are prefetched together
+    for (it = ro_index_seek(&fp->index, pos, &cur); it && it->offset < end;
+         it = ro_index_next(&cur)) {
+        if (it->zeroed) continue;
+        seg_begin = max_t(uint64_t, it->offset, pos);
+        seg_end = min_t(uint64_t, segment_end(it), end);
+        moffset = (it->moffset + (seg_begin - it->offset)) * SECTOR_SIZE;
+        if (moffset != run_end) {
+            if (run_end > run_begin)
+                zfile_prefetch(fp->fp, run_end - run_begin, run_begin);
+            run_begin = moffset;
+        }
+        run_end = moffset + (seg_end - seg_begin) * SECTOR_SIZE;
+    }
+    if (run_end > run_begin)
+        zfile_prefetch(fp->fp, run_end - run_begin, run_begin);
+}
+
+bool lsmt_map_extent(struct lsmt_file *fp, size_t count, loff_t offset,
+                     loff_t *moffset) {
+    struct segment_mapping s;
+    struct segment_mapping m;
+    u64 start;
+    int n;
+
+    if (!is_aligned(offset | count) || count == 0 ||
+        offset + count > fp->ht.virtual_size)
+        return false;
+    s.offset = offset / SECTOR_SIZE;
+    s.length = count / SECTOR_SIZE;
+    if (s.length != count / SECTOR_SIZE) return false;
+    start = ktime_get_ns();
+    n = ro_index_lookup(&fp->index, &s, &m, 1);
+    vbd_stat_time(&fp->fp->stats, VBD_LAT_INDEX, start);
+    if (n != 1) return false;
+    if (m.zeroed || m.offset != s.offset || m.length != s.length) return false;
+    *moffset = (loff_t)m.moffset * SECTOR_SIZE;
+    return true;
 }
 
 size_t lsmt_len(struct lsmt_file *fp) { return fp->ht.virtual_size; }
@@ -247,3 +884,90 @@ bool is_lsmtfile(struct zfile *fp) {
 
     return ht.magic0 == *MAGIC0 && uuid_equal(&ht.magic1, &MAGIC1);
 }
+
+static uint64_t bench_rand(uint64_t *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+void lsmt_index_bench(size_t max_segments, size_t lookups) {
+    struct lsmt_ro_index index;
+    struct lsmt_cursor cur;
+    const struct segment_mapping *it;
+    struct segment_mapping *p;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    uint64_t vsize, msize, t0, t_bs, t_tree, t_compact, sum = 0;
+    size_t n, i, flat_bytes, compact_bytes;
+
+    for (n = 1024; n <= max_segments; n *= 4) {
+        p = vmalloc(n * sizeof(struct segment_mapping));
+        if (!p) break;
+        // segments of 1..64 sectors with holes in between, data mostly
+        // laid out in order in underlay
+        vsize = 0;
+        msize = 0;
+        for (i = 0; i < n; i++) {
+            vsize += bench_rand(&seed) % 4;
+            p[i].offset = vsize;
+            p[i].length = 1 + bench_rand(&seed) % 64;
+            p[i].moffset = msize;
+            p[i].zeroed = bench_rand(&seed) % 16 == 0;
+            p[i].tag = 0;
+            vsize += p[i].length;
+            if (!p[i].zeroed) msize += p[i].length + bench_rand(&seed) % 2;
+        }
+        memset(&index, 0, sizeof(index));
+        index.mapping = p;
+        index.pbegin = p;
+        index.pend = p + n;
+        index.nr = n;
+        ro_index_build(&index);
+        if (!index.tree) {
+            vfree(p);
+            break;
+        }
+
+        t0 = ktime_get_ns();
+        for (i = 0; i < lookups; i++)
+            sum += ro_index_bsearch(&index, bench_rand(&seed) % vsize);
+        t_bs = ktime_get_ns() - t0;
+        t0 = ktime_get_ns();
+        for (i = 0; i < lookups; i++)
+            sum += ro_index_tree_search(&index, bench_rand(&seed) % vsize);
+        t_tree = ktime_get_ns() - t0;
+        flat_bytes = n * sizeof(struct segment_mapping) +
+                     (index.level_off[index.height - 1] + LSMT_BTREE_B) *
+                         sizeof(uint64_t);
+
+        ro_index_compact(&index);
+        if (!index.skip) {
+            vfree(index.tree);
+            vfree(p);
+            break;
+        }
+        // compact lookups decode from the skip array, never `mapping`
+        t0 = ktime_get_ns();
+        for (i = 0; i < lookups; i++) {
+            it = ro_index_seek(&index, bench_rand(&seed) % vsize, &cur);
+            sum += it ? it->moffset : 0;
+        }
+        t_compact = ktime_get_ns() - t0;
+        compact_bytes =
+            index.data_size + index.nr_blocks * sizeof(struct lsmt_skip);
+
+        pr_info("LSMT: bench segments=%lu bsearch=%llu ns/op tree=%llu ns/op "
+                "compact=%llu ns/op\n",
+                n, t_bs / lookups, t_tree / lookups, t_compact / lookups);
+        pr_info("LSMT: bench segments=%lu tree=%lu.%02lu B/seg "
+                "compact=%lu.%02lu B/seg\n",
+                n, flat_bytes / n, flat_bytes * 100 / n % 100,
+                compact_bytes / n, compact_bytes * 100 / n % 100);
+        vfree(index.skip);
+        vfree(index.data);
+        vfree(index.tree);
+        vfree(p);
+    }
+    pr_info("LSMT: bench done (%llu)\n", sum);
+}
@@ -1,6 +1,7 @@
 #ifndef __LSMT_RO_H__
 #define __LSMT_RO_H__
 
+#include <linux/kref.h>
 #include <linux/uuid.h>
 #include <linux/kthread.h>
 #include <linux/blk-mq.h>
@@ -29,27 +30,126 @@ struct segment_mapping {                             /* 8 + 8 bytes */
         uint8_t tag;
 }__attribute__((packed));
 
+// keys per node of the lookup tree, one cache line of `uint64_t`
+#define LSMT_BTREE_B 8
+#define LSMT_BTREE_MAX_HEIGHT 16
+
+// segments per block of the compact index
+#define LSMT_CBLOCK 64
+
+// first segment of a block of the compact index
+struct lsmt_skip {
+        uint64_t offset;
+        uint64_t moffset;
+        uint32_t pos;  // of the block in `data`
+} __attribute__((packed));
+
+// segments per page of the index on disk, 4 KiB
+#define LSMT_IPAGE 256
+
+// valid segments of an index page, loaded on demand
+struct lsmt_ipage {
+        size_t nr;
+        uint64_t last_end;  // end of the last segment, there is at least one
+        struct segment_mapping m[];
+};
+
 struct lsmt_ro_index {
         const struct segment_mapping *pbegin;
         const struct segment_mapping *pend;
         struct segment_mapping *mapping;
+        size_t nr;
+
+        // compact form, replacing `mapping` if built. segments are kept in
+        // blocks of LSMT_CBLOCK, each a varint stream of (gap from the end
+        // of the previous segment, length << 1 | zeroed, zigzag moffset
+        // delta from the end of the previous data segment), searched by
+        // the first offset of each block in `skip`. NULL if not built.
+        struct lsmt_skip *skip;
+        uint8_t *data;
+        size_t nr_blocks;
+        size_t data_size;
+
+        // static B+ tree of segment end offsets, kept apart from the
+        // mappings. level 0 holds the end of every segment, each key of
+        // level h + 1 is the last key of a node in level h. levels are
+        // padded to whole nodes with U64_MAX. NULL if not built.
+        uint64_t *tree;
+        size_t level_off[LSMT_BTREE_MAX_HEIGHT];
+        int height;
+
+        // lazy form, replacing both if set. pages are read from `fp` when
+        // a search first touches them, see `ro_index_page`
+        struct lsmt_ipage **pages;
+        size_t nr_pages;
+        struct zfile *fp;
+        loff_t index_offset;
+        size_t index_size;  // segments on disk, invalid ones included
+};
+
+// position in either form of the index, see `ro_index_seek`
+struct lsmt_cursor {
+        const struct lsmt_ro_index *index;
+        const struct segment_mapping *it;
+        // compact index, `m` is the segment decoded last
+        struct segment_mapping m;
+        size_t blk;
+        size_t left;  // segments of the block not decoded yet
+        const uint8_t *p;
+        uint64_t end, mend;
+        // lazy index, `it` runs up to `pend` within page `page`
+        const struct segment_mapping *pend;
+        size_t page;
+        bool nowait;  // take loaded pages only
+        int err;      // a page could not be loaded
 };
 
 struct lsmt_file {
         struct zfile *fp;
         struct lsmt_ht ht;
         struct lsmt_ro_index index;
+        // shared by all opening the same zfile, see `lsmt_open`
+        struct kref ref;
+        struct list_head layer;
 };
 
 // lsmt_file functions... 
 // in `lsmt_file`, all data read by using `zfile_read`
 //
+// takes over the reference of `zf`, which is closed on failure too. devices
+// opening the same layer share one lsmt_file, index and zfile, until the
+// last `lsmt_close`
 struct lsmt_file* lsmt_open(struct zfile* zf);
 ssize_t lsmt_read(struct lsmt_file* fp, void* buff, size_t count, loff_t offset);
+// read [offset, offset + count) into `to` with a single index walk, each
+// data segment costs one `zfile_read_iter`
+ssize_t lsmt_read_iter(struct lsmt_file* fp, struct iov_iter* to,
+                       size_t count, loff_t offset);
+// the same, without sleeping: only for what needs neither index pages not
+// loaded yet nor back file reads, -EAGAIN otherwise, see `zfile_read_cached`
+ssize_t lsmt_read_cached(struct lsmt_file* fp, struct iov_iter* to,
+                         size_t count, loff_t offset);
+// true if [offset, offset + count) has no data segment, so it reads as all
+// zero. never sleeps: false if that is only known by loading index pages
+bool lsmt_is_zero(struct lsmt_file* fp, size_t count, loff_t offset);
+// prefetch data segments backing [offset, offset + count) into the block
+// cache of underlay zfile, see `zfile_prefetch`
+void lsmt_prefetch(struct lsmt_file* fp, size_t count, loff_t offset);
 size_t lsmt_len(struct lsmt_file *fp);
+// load all of a lazily loaded index, and jump table of underlay zfile
+int lsmt_warm(struct lsmt_file* fp);
 void lsmt_close(struct lsmt_file *fp);
 struct path lsmt_getpath(struct lsmt_file* file);
 struct file* lsmt_getfile(struct lsmt_file* file);
+struct zfile* lsmt_getzfile(struct lsmt_file* file);
+// map [offset, offset + count) to its offset in underlay zfile, only if the
+// whole range is backed by a single data segment
+bool lsmt_map_extent(struct lsmt_file* fp, size_t count, loff_t offset,
+                     loff_t* moffset);
 bool is_lsmtfile(struct zfile* zf);
 
+// microbenchmark of index lookup, ns/op against index size up to
+// `max_segments`, reported by pr_info
+void lsmt_index_bench(size_t max_segments, size_t lookups);
+
 #endif
\ No newline at end of file
@@ -12,26 +12,40 @@
 #include <linux/backing-dev.h>
 #include <linux/bio.h>
 #include <linux/blkdev.h>
+#include <linux/debugfs.h>
 #include <linux/fs.h>
 #include <linux/highmem.h>
 #include <linux/init.h>
 #include <linux/initrd.h>
+#include <linux/ioprio.h>
+#include <linux/ktime.h>
 #include <linux/major.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
 #include <linux/mutex.h>
 #include <linux/radix-tree.h>
+#include <linux/sched/mm.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
 
+#include "lcache.h"
 #include "lsmt.h"
+#include "stats.h"
 #include "zfile.h"
 #include "overlay_vbd.h"
 
+// tracepoints of zfile and lsmt are defined here as well
+#define CREATE_TRACE_POINTS
+#include "vbd_trace.h"
+
 
 #define PAGE_SECTORS_SHIFT (PAGE_SHIFT - SECTOR_SHIFT)
 #define PAGE_SECTORS (1 << PAGE_SECTORS_SHIFT)
 #define OVBD_MAJOR 231
+// local cache file grows up to this size at most
 #define OVBD_CACHE_SIZE 536870912000
 
 static const struct block_device_operations ovbd_fops = {
@@ -53,17 +67,78 @@ static int max_part = 1;
 module_param(max_part, int, 0444);
 MODULE_PARM_DESC(max_part, "Num Minors to reserve between devices");
 
+static unsigned int nr_queues;
+module_param(nr_queues, uint, 0444);
+MODULE_PARM_DESC(nr_queues,
+                 "Hardware queues (and workers) per device, 0 for one per CPU");
+
+static bool aio;
+module_param(aio, bool, 0444);
+MODULE_PARM_DESC(aio, "Read compressed data from back file asynchronously");
+
+static unsigned int index_bench;
+module_param(index_bench, uint, 0444);
+MODULE_PARM_DESC(index_bench,
+                 "Run index lookup microbenchmark up to this many segments "
+                 "at load, 0 to skip");
+
+static unsigned int codec_bench;
+module_param(codec_bench, uint, 0444);
+MODULE_PARM_DESC(codec_bench,
+                 "Run decompression microbenchmark of each codec over this "
+                 "many 64 KiB blocks at load, 0 to skip");
+
+static unsigned int readahead_kb = 2048;
+module_param(readahead_kb, uint, 0644);
+MODULE_PARM_DESC(readahead_kb,
+                 "Max readahead window of a sequential or strided stream in "
+                 "KiB, 0 to disable");
+
+static int verify = ZF_VERIFY_FIRST;
+module_param(verify, int, 0444);
+MODULE_PARM_DESC(verify,
+                 "Block checksum verification of devices, 0 off, 1 on every "
+                 "decompression, 2 on first one of each block");
+
+static bool warm_index;
+module_param(warm_index, bool, 0444);
+MODULE_PARM_DESC(warm_index,
+                 "Load lazily loaded index and jump table of a device in "
+                 "background once it is attached");
+
+static bool inline_read = true;
+module_param(inline_read, bool, 0644);
+MODULE_PARM_DESC(inline_read,
+                 "Complete reads of zero ranges and cached blocks when "
+                 "queued, instead of in the worker");
+
 static char *backfile = "/test.lsmtz";
 module_param(backfile, charp, 0660);
 MODULE_PARM_DESC(backfile, "Back file for lsmtz");
 
+static char *cachefile = "";
+module_param(cachefile, charp, 0444);
+MODULE_PARM_DESC(cachefile,
+                 "Local file caching compressed data of back file, kept "
+                 "across loads, empty for none");
+
+// `vbd/vbd<n>/stats` of each device, see `ovbd_stats_show`
+static struct dentry *ovbd_debugfs;
+
 MODULE_LICENSE("GPL");
 MODULE_ALIAS_BLOCKDEV_MAJOR(OVBD_MAJOR);
 MODULE_ALIAS("vbd");
 
 static void ovbd_unprepare_queue(struct ovbd_device *lo) {
-    kthread_flush_worker(&lo->worker);
-    kthread_stop(lo->worker_task);
+    unsigned int i;
+
+    for (i = 0; i < lo->nr_queues; i++) {
+        if (IS_ERR_OR_NULL(lo->queues[i].worker_task)) continue;
+        kthread_flush_worker(&lo->queues[i].worker);
+        kthread_stop(lo->queues[i].worker_task);
+    }
+    kfree(lo->queues);
+    lo->queues = NULL;
 }
 
 static int ovbd_kthread_worker_fn(void *worker_ptr) {
@@ -72,11 +147,24 @@ static int ovbd_kthread_worker_fn(void *worker_ptr) {
 }
 
 static int ovbd_prepare_queue(struct ovbd_device *lo, int idx) {
-    kthread_init_worker(&lo->worker);
-    lo->worker_task =
-        kthread_run(ovbd_kthread_worker_fn, &lo->worker, "loop%d", idx);
-    if (IS_ERR(lo->worker_task)) return -ENOMEM;
-    set_user_nice(lo->worker_task, MIN_NICE);
+    unsigned int i;
+
+    lo->nr_queues = nr_queues ? nr_queues : num_online_cpus();
+    lo->queues = kcalloc(lo->nr_queues, sizeof(struct ovbd_queue), GFP_KERNEL);
+    if (!lo->queues) return -ENOMEM;
+
+    for (i = 0; i < lo->nr_queues; i++) {
+        struct ovbd_queue *q = &lo->queues[i];
+
+        kthread_init_worker(&q->worker);
+        q->worker_task = kthread_run(ovbd_kthread_worker_fn, &q->worker,
+                                     "vbd%d-%u", idx, i);
+        if (IS_ERR(q->worker_task)) {
+            ovbd_unprepare_queue(lo);
+            return -ENOMEM;
+        }
+        set_user_nice(q->worker_task, MIN_NICE);
+    }
     return 0;
 }
 
@@ -87,38 +175,298 @@ static int ovbd_prepare_queue(struct ovbd_device *lo, int idx) {
 static LIST_HEAD(ovbd_devices);
 static DEFINE_MUTEX(ovbd_devices_mutex);
 
-static int ovbd_read_simple(struct ovbd_device *ovbd, struct request *rq,
-                            loff_t pos) {
+/*
+ * Build an iov_iter over the request pages, in the same way as lo_rw_aio().
+ * The bvec table of a request with several bios goes to the preallocated
+ * `cmd->bvecs`, or to `cmd->bvec` allocated here if it does not fit, which
+ * fails with -EAGAIN instead if `nowait`.
+ */
+static int ovbd_rq_iter(struct ovbd_cmd *cmd, struct request *rq,
+                        struct iov_iter *iter, bool nowait) {
+    struct bio *bio = rq->bio;
+    struct bio_vec *bvec;
+    unsigned int offset;
+    int nr_bvec = 0;
+
+    if (rq->bio != rq->biotail) {
+        struct req_iterator rq_iter;
+        struct bio_vec tmp;
+
+        rq_for_each_bvec(tmp, rq, rq_iter) nr_bvec++;
+
+        if (nr_bvec > OVBD_MAX_SEGMENTS) {
+            if (nowait) return -EAGAIN;
+            cmd->bvec =
+                kmalloc_array(nr_bvec, sizeof(struct bio_vec), GFP_NOIO);
+            if (!cmd->bvec) return -EIO;
+            bvec = cmd->bvec;
+        } else {
+            bvec = cmd->bvecs;
+        }
+
+        rq_for_each_bvec(tmp, rq, rq_iter) {
+            *bvec = tmp;
+            bvec++;
+        }
+        bvec -= nr_bvec;
+        offset = 0;
+    } else {
+        offset = bio->bi_iter.bi_bvec_done;
+        bvec = __bvec_iter_bvec(bio->bi_io_vec, bio->bi_iter);
+        nr_bvec = bio_segments(bio);
+    }
+    iov_iter_bvec(iter, READ, bvec, nr_bvec, blk_rq_bytes(rq));
+    iter->iov_offset = offset;
+    return 0;
+}
+
+static int ovbd_read_simple(struct ovbd_device *ovbd, struct ovbd_cmd *cmd,
+                            struct request *rq, loff_t pos) {
+    struct req_iterator rq_iter;
     struct bio_vec bvec;
-    struct req_iterator iter;
+    struct iov_iter iter;
     ssize_t len;
-    void *mem;
+    int ret;
 
-    rq_for_each_segment(bvec, rq, iter) {
-        mem = kmap_atomic(bvec.bv_page);
-        len = lsmt_read(ovbd->fp, mem + bvec.bv_offset, bvec.bv_len, pos);
-        kunmap_atomic(mem);
+    ret = ovbd_rq_iter(cmd, rq, &iter, false);
+    if (ret) return ret;
 
-        if (len < bvec.bv_len) {
-            return len;
-        }
+    // resolve and read the whole request at once, so each compressed block
+    // is fetched and decompressed once, then scattered into all its bvecs
+    len = lsmt_read_iter(ovbd->fp, &iter, blk_rq_bytes(rq), pos);
+    kfree(cmd->bvec);
+    cmd->bvec = NULL;
+    if (len != blk_rq_bytes(rq)) return len < 0 ? len : -EIO;
+
+    rq_for_each_segment(bvec, rq, rq_iter) flush_dcache_page(bvec.bv_page);
+    return 0;
+}
 
-        if (len != bvec.bv_len) {
-            struct bio *bio;
+static void ovbd_aio_free(struct ovbd_cmd *cmd) {
+    struct request *rq = blk_mq_rq_from_pdu(cmd);
+    struct ovbd_device *lo = rq->q->queuedata;
 
-            __rq_for_each_bio(bio, rq) zero_fill_bio(bio);
-            break;
-        }
-        flush_dcache_page(bvec.bv_page);
-        cond_resched();
-        pos += bvec.bv_len;
+    zfile_scratch_put(lsmt_getzfile(lo->fp), cmd->scr);
+    kfree(cmd->bvec);
+    cmd->scr = NULL;
+    cmd->bvec = NULL;
+}
+
+// decompress the fetched range into request pages, and complete it.
+// always runs in process context
+static void ovbd_aio_finish(struct ovbd_cmd *cmd) {
+    struct request *rq = blk_mq_rq_from_pdu(cmd);
+    struct ovbd_device *lo = rq->q->queuedata;
+    struct zfile *zf = lsmt_getzfile(lo->fp);
+    struct req_iterator rq_iter;
+    struct iov_iter iter;
+    struct bio_vec bvec;
+    loff_t begin, range;
+    ssize_t ret = cmd->ret;
+
+    cmd->ret = -EIO;
+    if (zfile_range(zf, blk_rq_bytes(rq), cmd->moffset, &begin, &range))
+        goto out;
+    if (ret < begin + range - cmd->cbegin) {
+        pr_info("vbd: aio read %lld failed, ret=%ld\n", cmd->cbegin, ret);
+        goto out;
     }
+    trace_vbd_fetch(cmd->cbegin, ret, true,
+                    ktime_get_ns() - cmd->fetch_start);
+    vbd_stat_add(&zf->stats, VBD_FETCHED, ret);
+    vbd_stat_time(&zf->stats, VBD_LAT_BACKING, cmd->fetch_start);
+    invalidate_kernel_vmap_range(cmd->scr->cbuf, ret);
+    if (ovbd_rq_iter(cmd, rq, &iter, false)) goto out;
+    ret = zfile_decompress_iter(zf, &iter, blk_rq_bytes(rq), cmd->moffset,
+                                cmd->scr, cmd->cbegin);
+    if (ret != blk_rq_bytes(rq)) goto out;
+    rq_for_each_segment(bvec, rq, rq_iter) flush_dcache_page(bvec.bv_page);
+    cmd->ret = 0;
+out:
+    ovbd_aio_free(cmd);
+    blk_mq_complete_request(rq);
+}
 
-    return 0;
+static void ovbd_aio_work(struct kthread_work *work) {
+    ovbd_aio_finish(container_of(work, struct ovbd_cmd, aio_work));
+}
+
+static void ovbd_aio_complete(struct kiocb *iocb, long ret, long ret2) {
+    struct ovbd_cmd *cmd = container_of(iocb, struct ovbd_cmd, iocb);
+    struct request *rq = blk_mq_rq_from_pdu(cmd);
+    struct ovbd_queue *q = rq->mq_hctx->driver_data;
+
+    cmd->ret = ret;
+    // direct I/O completes in interrupt context, where the block cache may
+    // not be used, so finish it on the queue worker
+    if (in_task())
+        ovbd_aio_finish(cmd);
+    else
+        kthread_queue_work(&q->worker, &cmd->aio_work);
+}
+
+static bool ovbd_can_use_dio(struct file *file) {
+    return file->f_mapping->a_ops && file->f_mapping->a_ops->direct_IO;
+}
+
+static unsigned int ovbd_dio_align(struct file *file) {
+    struct inode *inode = file->f_mapping->host;
+
+    if (inode->i_sb->s_bdev) return bdev_logical_block_size(inode->i_sb->s_bdev);
+    return SECTOR_SIZE;
+}
+
+/*
+ * Issue the back file read of the compressed range covering a request, in
+ * the same way as lo_rw_aio(), and decompress in its completion. So that a
+ * worker keeps many reads in flight instead of sleeping in kernel_read.
+ * Only requests backed by a single data segment which are not fully cached
+ * take this path, others return -EAGAIN and go through ovbd_read_simple.
+ */
+static int ovbd_read_aio(struct ovbd_device *lo, struct ovbd_cmd *cmd,
+                         struct request *rq, loff_t pos) {
+    struct zfile *zf = lsmt_getzfile(lo->fp);
+    struct file *file = zfile_getfile(zf);
+    loff_t begin, range, end;
+    unsigned int align = 1;
+    struct iov_iter iter;
+    unsigned int i, nr_pages;
+    int ret;
+
+    // back file is read through the local cache then
+    if (zf->lcache) return -EAGAIN;
+    if (!lsmt_map_extent(lo->fp, blk_rq_bytes(rq), pos, &cmd->moffset))
+        return -EAGAIN;
+    if (zfile_cached(zf, blk_rq_bytes(rq), cmd->moffset)) return -EAGAIN;
+    if (zfile_range(zf, blk_rq_bytes(rq), cmd->moffset, &begin, &range))
+        return -EAGAIN;
+
+    if (ovbd_can_use_dio(file)) align = ovbd_dio_align(file);
+    cmd->cbegin = round_down(begin, align);
+    end = round_up(begin + range, align);
+    if (end - cmd->cbegin > (loff_t)cmd->nr_cvec << PAGE_SHIFT) return -EAGAIN;
+    // read into a pooled scratch, but never wait for one as completions of
+    // reads holding them may be queued behind this very worker
+    cmd->scr = zfile_scratch_tryget(zf);
+    if (!cmd->scr) return -EAGAIN;
+    nr_pages = DIV_ROUND_UP(end - cmd->cbegin, PAGE_SIZE);
+    for (i = 0; i < nr_pages; i++) {
+        cmd->cvec[i].bv_page =
+            vmalloc_to_page(cmd->scr->cbuf + ((size_t)i << PAGE_SHIFT));
+        cmd->cvec[i].bv_offset = 0;
+        cmd->cvec[i].bv_len = PAGE_SIZE;
+    }
+
+    iov_iter_bvec(&iter, READ, cmd->cvec, nr_pages,
+                  (size_t)nr_pages << PAGE_SHIFT);
+    cmd->iocb.ki_pos = cmd->cbegin;
+    cmd->iocb.ki_filp = file;
+    cmd->iocb.ki_complete = ovbd_aio_complete;
+    cmd->iocb.ki_flags = align > 1 ? IOCB_DIRECT : 0;
+    cmd->iocb.ki_ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_NONE, 0);
+
+    cmd->fetch_start = ktime_get_ns();
+    ret = call_read_iter(file, &cmd->iocb, &iter);
+    if (ret != -EIOCBQUEUED) ovbd_aio_complete(&cmd->iocb, ret, 0);
+    return -EIOCBQUEUED;
+}
+
+static void ovbd_stream_work(struct work_struct *work) {
+    struct ovbd_stream *s = container_of(work, struct ovbd_stream, work);
+    struct ovbd_device *lo = s->ovbd;
+    loff_t from, to, stride;
+    unsigned int noio;
+    size_t len;
+
+    spin_lock(&lo->stream_lock);
+    from = s->ra_pos;
+    to = s->ra_next;
+    stride = s->stride;
+    len = s->len;
+    s->ra_pos = to;
+    spin_unlock(&lo->stream_lock);
+    if (from >= to) return;
+
+    // runs on behalf of block I/O, allocations must not recurse into it
+    noio = memalloc_noio_save();
+    if (stride == len) {
+        lsmt_prefetch(lo->fp, to - from, from);
+    } else {
+        for (; from < to; from += stride) lsmt_prefetch(lo->fp, len, from);
+    }
+    memalloc_noio_restore(noio);
+}
+
+/*
+ * Match a read request against the streams of `lo`, and queue readahead of
+ * the stream it belongs to. A request at `last + stride` is a hit and
+ * doubles the window; one shortly after `last` sets up a new stride with
+ * the window collapsed; any other request takes over the least recently
+ * used slot. Readahead fills the zfile block cache, where requests of the
+ * stream find their blocks decompressed already.
+ */
+static void ovbd_stream_update(struct ovbd_device *lo, loff_t pos,
+                               size_t len) {
+    size_t max_window = (size_t)readahead_kb << 10;
+    struct ovbd_stream *s, *near = NULL, *lru = &lo->streams[0];
+    loff_t from, to;
+    int i;
+
+    if (!max_window) return;
+    spin_lock(&lo->stream_lock);
+    for (i = 0; i < OVBD_STREAMS; i++) {
+        s = &lo->streams[i];
+        if (s->len && s->stride && pos == s->last + s->stride) {
+            s->window = min(max(s->window * 2, len), max_window);
+            goto found;
+        }
+        if (!near && s->len && pos > s->last &&
+            pos - s->last <= s->len + max_window)
+            near = s;
+        if (s->used < lru->used) lru = s;
+    }
+    if (near) {
+        s = near;
+        s->stride = pos - s->last;
+        s->window = min(len, max_window);
+        s->ra_pos = s->ra_next = 0;
+        goto found;
+    }
+    s = lru;
+    s->last = pos;
+    s->len = len;
+    s->stride = 0;
+    s->window = 0;
+    s->ra_pos = s->ra_next = 0;
+    s->used = ++lo->stream_clock;
+    spin_unlock(&lo->stream_lock);
+    return;
+
+found:
+    // sequential streams follow changes of request length
+    if (s->stride == s->len) s->stride = len;
+    s->last = pos;
+    s->len = len;
+    s->used = ++lo->stream_clock;
+    from = max(s->ra_next, pos + s->stride);
+    if (s->stride == len)
+        to = pos + len + s->window;
+    else
+        to = pos + s->stride * (1 + max_t(size_t, s->window / len, 1));
+    if (to > from) {
+        // keep what is queued but not taken yet, unless passed already
+        s->ra_pos = max(s->ra_pos, pos + s->stride);
+        s->ra_next = to;
+        queue_work(system_unbound_wq, &s->work);
+    }
+    spin_unlock(&lo->stream_lock);
 }
 
 static int do_req_filebacked(struct ovbd_device *lo, struct request *rq) {
+    struct ovbd_cmd *cmd = blk_mq_rq_to_pdu(rq);
     loff_t pos;
+    int ret;
+
     pos = ((loff_t)blk_rq_pos(rq) << 9);
 
     /*
@@ -132,7 +480,12 @@ static int do_req_filebacked(struct ovbd_device *lo, struct request *rq) {
      */
     switch (req_op(rq)) {
         case REQ_OP_READ:
-            return ovbd_read_simple(lo, rq, pos);
+            ovbd_stream_update(lo, pos, blk_rq_bytes(rq));
+            if (aio) {
+                ret = ovbd_read_aio(lo, cmd, rq, pos);
+                if (ret != -EAGAIN) return ret;
+            }
+            return ovbd_read_simple(lo, cmd, rq, pos);
         default:
             WARN_ON_ONCE(1);
             return -EIO;
@@ -145,12 +498,15 @@ static void ovbd_handle_cmd(struct ovbd_cmd *cmd) {
     struct ovbd_device *lo = rq->q->queuedata;
     int ret = 0;
 
+    cmd->ret = 0;
     if (write) {
         ret = -EIO;
         goto failed;
     }
 
     ret = do_req_filebacked(lo, rq);
+    /* aio request completes in ovbd_aio_finish */
+    if (ret == -EIOCBQUEUED) return;
 failed:
     /* complete non-aio request */
     if (ret) {
@@ -165,60 +521,224 @@ failed:
 
 static void ovbd_queue_work(struct kthread_work *work) {
     struct ovbd_cmd *cmd = container_of(work, struct ovbd_cmd, work);
+    struct request *rq = blk_mq_rq_from_pdu(cmd);
+    struct ovbd_device *lo = rq->q->queuedata;
 
+    trace_vbd_rq_start(lo->ovbd_number, rq);
     ovbd_handle_cmd(cmd);
 }
 
 static int ovbd_init_request(struct blk_mq_tag_set *set, struct request *rq,
                              unsigned int hctx_idx, unsigned int numa_node) {
     struct ovbd_cmd *cmd = blk_mq_rq_to_pdu(rq);
+    struct ovbd_device *lo = set->driver_data;
+    struct zfile *zf = lsmt_getzfile(lo->fp);
 
     kthread_init_work(&cmd->work, ovbd_queue_work);
+    kthread_init_work(&cmd->aio_work, ovbd_aio_work);
+    // tables sized once here, so requests do not allocate them
+    cmd->bvecs = kmalloc_array_node(OVBD_MAX_SEGMENTS, sizeof(struct bio_vec),
+                                    GFP_KERNEL, numa_node);
+    if (!cmd->bvecs) return -ENOMEM;
+    if (aio) {
+        cmd->nr_cvec = zfile_scratch_size(zf) >> PAGE_SHIFT;
+        cmd->cvec = kmalloc_array_node(cmd->nr_cvec, sizeof(struct bio_vec),
+                                       GFP_KERNEL, numa_node);
+        if (!cmd->cvec) {
+            kfree(cmd->bvecs);
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+static void ovbd_exit_request(struct blk_mq_tag_set *set, struct request *rq,
+                              unsigned int hctx_idx) {
+    struct ovbd_cmd *cmd = blk_mq_rq_to_pdu(rq);
+
+    kfree(cmd->bvecs);
+    kfree(cmd->cvec);
+}
+
+static int ovbd_init_hctx(struct blk_mq_hw_ctx *hctx, void *data,
+                          unsigned int hctx_idx) {
+    struct ovbd_device *lo = data;
+
+    hctx->driver_data = &lo->queues[hctx_idx];
     return 0;
 }
 
+// a read of holes and zeroed segments only is served right here by zeroing
+// its pages, without a worker hop or any back file access
+static bool ovbd_read_zero(struct ovbd_device *lo, struct request *rq,
+                           loff_t pos) {
+    struct req_iterator rq_iter;
+    struct bio_vec bvec;
+
+    if (!lsmt_is_zero(lo->fp, blk_rq_bytes(rq), pos)) return false;
+    rq_for_each_segment(bvec, rq, rq_iter)
+        zero_user(bvec.bv_page, bvec.bv_offset, bvec.bv_len);
+    vbd_stat_add(&lo->stats, VBD_ZERO_BYTES, blk_rq_bytes(rq));
+    return true;
+}
+
+// likewise a read of blocks all in the block cache is copied out on the
+// submitting CPU. on a miss, pages copied so far are read again by the worker
+static bool ovbd_read_cached(struct ovbd_device *lo, struct ovbd_cmd *cmd,
+                             struct request *rq, loff_t pos) {
+    struct req_iterator rq_iter;
+    struct bio_vec bvec;
+    struct iov_iter iter;
+
+    if (ovbd_rq_iter(cmd, rq, &iter, true)) return false;
+    if (lsmt_read_cached(lo->fp, &iter, blk_rq_bytes(rq), pos) !=
+        blk_rq_bytes(rq))
+        return false;
+    rq_for_each_segment(bvec, rq, rq_iter) flush_dcache_page(bvec.bv_page);
+    return true;
+}
+
+// serve a read from memory in `ovbd_queue_rq`, where nothing may sleep
+static bool ovbd_read_inline(struct ovbd_device *lo, struct ovbd_cmd *cmd,
+                             struct request *rq) {
+    loff_t pos = (loff_t)blk_rq_pos(rq) << 9;
+
+    if (!inline_read || req_op(rq) != REQ_OP_READ) return false;
+    if (!ovbd_read_zero(lo, rq, pos) && !ovbd_read_cached(lo, cmd, rq, pos))
+        return false;
+    // keep stream detection going, readahead is what makes later reads hit
+    ovbd_stream_update(lo, pos, blk_rq_bytes(rq));
+    return true;
+}
+
 static blk_status_t ovbd_queue_rq(struct blk_mq_hw_ctx *hctx,
                                   const struct blk_mq_queue_data *bd) {
     struct request *rq = bd->rq;
     struct ovbd_cmd *cmd = blk_mq_rq_to_pdu(rq);
+    struct ovbd_queue *q = hctx->driver_data;
     struct ovbd_device *lo = rq->q->queuedata;
 
+    trace_vbd_queue_rq(lo->ovbd_number, rq);
+    cmd->start = ktime_get_ns();
     blk_mq_start_request(rq);
 
-    /* always use the first bio's css */
-    kthread_queue_work(&lo->worker, &cmd->work);
+    if (ovbd_read_inline(lo, cmd, rq)) {
+        cmd->ret = 0;
+        blk_mq_complete_request(rq);
+        return BLK_STS_OK;
+    }
+    kthread_queue_work(&q->worker, &cmd->work);
 
     return BLK_STS_OK;
 }
 
 static void ovbd_complete_rq(struct request *rq) {
     struct ovbd_cmd *cmd = blk_mq_rq_to_pdu(rq);
+    struct ovbd_device *lo = rq->q->queuedata;
     blk_status_t ret = BLK_STS_OK;
 
-    if (cmd->ret < 0) ret = errno_to_blk_status(cmd->ret);
+    trace_vbd_complete_rq(lo->ovbd_number, rq, cmd->ret < 0 ? cmd->ret : 0);
+    if (cmd->ret < 0) {
+        ret = errno_to_blk_status(cmd->ret);
+    } else {
+        vbd_stat_add(&lo->stats, VBD_REQUESTS, 1);
+        vbd_stat_add(&lo->stats, VBD_BYTES, blk_rq_bytes(rq));
+        vbd_stat_time(&lo->stats, VBD_LAT_REQUEST, cmd->start);
+    }
     blk_mq_end_request(rq, ret);
 }
 
 static const struct blk_mq_ops ovbd_mq_ops = {
     .queue_rq = ovbd_queue_rq,
+    .init_hctx = ovbd_init_hctx,
     .init_request = ovbd_init_request,
+    .exit_request = ovbd_exit_request,
     .complete = ovbd_complete_rq,
 };
 
+// stats of the device, then of its layer, which other devices on the same
+// layer add to as well
+static int ovbd_stats_show(struct seq_file *m, void *v) {
+    struct ovbd_device *lo = m->private;
+
+    vbd_stats_show(m, &lo->stats);
+    seq_puts(m, "layer:\n");
+    vbd_stats_show(m, &lsmt_getzfile(lo->fp)->stats);
+    return 0;
+}
+
+static int ovbd_stats_open(struct inode *inode, struct file *file) {
+    return single_open(file, ovbd_stats_show, inode->i_private);
+}
+
+// any write resets stats of the device and its layer
+static ssize_t ovbd_stats_write(struct file *file, const char __user *buf,
+                                size_t count, loff_t *ppos) {
+    struct ovbd_device *lo = ((struct seq_file *)file->private_data)->private;
+
+    vbd_stats_reset(&lo->stats);
+    vbd_stats_reset(&lsmt_getzfile(lo->fp)->stats);
+    return count;
+}
+
+static const struct file_operations ovbd_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = ovbd_stats_open,
+    .read = seq_read,
+    .write = ovbd_stats_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static void ovbd_warm_work(struct work_struct *work) {
+    struct ovbd_device *lo = container_of(work, struct ovbd_device, warm);
+    ktime_t start = ktime_get();
+    int ret;
+
+    ret = lsmt_warm(lo->fp);
+    pr_info("vbd%d: index warmed in %lld us, ret=%d\n", lo->ovbd_number,
+            ktime_us_delta(ktime_get(), start), ret);
+}
+
 static struct ovbd_device *ovbd_alloc(int i) {
     struct ovbd_device *ovbd;
     struct gendisk *disk;
-    int err;
+    int err, j;
     size_t flen;
 
     ovbd = kzalloc(sizeof(*ovbd), GFP_KERNEL);
     if (!ovbd) goto out;
     ovbd->ovbd_number = i;
+    spin_lock_init(&ovbd->stream_lock);
+    for (j = 0; j < OVBD_STREAMS; j++) {
+        INIT_WORK(&ovbd->streams[j].work, ovbd_stream_work);
+        ovbd->streams[j].ovbd = ovbd;
+    }
+    INIT_WORK(&ovbd->warm, ovbd_warm_work);
     // spin_lock_init(&ovbd->ovbd_lock);
     // INIT_RADIX_TREE(&ovbd->ovbd_pages, GFP_ATOMIC);
 
+    // opened first, request buffers are sized from it in init_request
+    ovbd->fp = lsmt_open(zfile_open(backfile));
+    if (!ovbd->fp) {
+        pr_info("Cannot load lsmtfile\n");
+        goto out_free_dev;
+    }
+    ovbd->verify = verify;
+    zfile_get_verify(lsmt_getzfile(ovbd->fp), ovbd->verify);
+    // a layer shared with another device has its cache opened already
+    if (cachefile[0] && !lsmt_getzfile(ovbd->fp)->lcache) {
+        struct zfile *zf = lsmt_getzfile(ovbd->fp);
+
+        zfile_set_lcache(zf, lcache_open(cachefile, zfile_getfile(zf),
+                                         OVBD_CACHE_SIZE));
+    }
+
+    err = ovbd_prepare_queue(ovbd, i);
+    if (err) goto out_close;
+
     ovbd->tag_set.ops = &ovbd_mq_ops;
-    ovbd->tag_set.nr_hw_queues = 1;
+    ovbd->tag_set.nr_hw_queues = ovbd->nr_queues;
     ovbd->tag_set.queue_depth = 128;
     ovbd->tag_set.numa_node = NUMA_NO_NODE;
     ovbd->tag_set.cmd_size = sizeof(struct ovbd_cmd);
@@ -226,7 +746,7 @@ static struct ovbd_device *ovbd_alloc(int i) {
     ovbd->tag_set.driver_data = ovbd;
 
     err = blk_mq_alloc_tag_set(&ovbd->tag_set);
-    if (err) goto out_free_dev;
+    if (err) goto out_unprepare_queue;
 
     ovbd->ovbd_queue = blk_mq_init_queue(&ovbd->tag_set);
     if (IS_ERR(ovbd->ovbd_queue)) {
@@ -254,13 +774,9 @@ static struct ovbd_device *ovbd_alloc(int i) {
     disk->flags = GENHD_FL_EXT_DEVT | GENHD_FL_NO_PART_SCAN;
     sprintf(disk->disk_name, "vbd%d", i);
     pr_info("vbd: disk->disk_name %s\n", disk->disk_name);
-    ovbd->fp = lsmt_open(zfile_open(backfile));
-    if (!ovbd->fp) {
-        pr_info("Cannot load lsmtfile\n");
-        goto out_free_queue;
-    }
-    err = ovbd_prepare_queue(ovbd, i);
-    if (err) goto out_free_queue;
+    if (vbd_stats_init(&ovbd->stats)) goto out_put_disk;
+    ovbd->debugfs = debugfs_create_dir(disk->disk_name, ovbd_debugfs);
+    debugfs_create_file("stats", 0600, ovbd->debugfs, ovbd, &ovbd_stats_fops);
 
     // 此处为loop形式，文件长度即blockdev的大小
     // 如果是LSMTFile，则应以LSMTFile头记录的长度为准
@@ -274,12 +790,20 @@ static struct ovbd_device *ovbd_alloc(int i) {
     blk_queue_flag_clear(QUEUE_FLAG_ADD_RANDOM, ovbd->ovbd_queue);
     set_disk_ro(disk, true);
 
+    if (warm_index) queue_work(system_unbound_wq, &ovbd->warm);
     return ovbd;
 
+out_put_disk:
+    put_disk(disk);
 out_free_queue:
     blk_cleanup_queue(ovbd->ovbd_queue);
 out_cleanup_tags:
     blk_mq_free_tag_set(&ovbd->tag_set);
+out_unprepare_queue:
+    ovbd_unprepare_queue(ovbd);
+out_close:
+    zfile_put_verify(lsmt_getzfile(ovbd->fp), ovbd->verify);
+    lsmt_close(ovbd->fp);
 out_free_dev:
     kfree(ovbd);
 out:
@@ -287,9 +811,19 @@ out:
 }
 
 static void ovbd_free(struct ovbd_device *ovbd) {
+    int i;
+
     put_disk(ovbd->ovbd_disk);
     blk_cleanup_queue(ovbd->ovbd_queue);
-    if (ovbd->fp) lsmt_close(ovbd->fp);
+    for (i = 0; i < OVBD_STREAMS; i++)
+        cancel_work_sync(&ovbd->streams[i].work);
+    cancel_work_sync(&ovbd->warm);
+    debugfs_remove_recursive(ovbd->debugfs);
+    vbd_stats_destroy(&ovbd->stats);
+    if (ovbd->fp) {
+        zfile_put_verify(lsmt_getzfile(ovbd->fp), ovbd->verify);
+        lsmt_close(ovbd->fp);
+    }
     kfree(ovbd);
 }
 
@@ -359,7 +893,16 @@ static int __init ovbd_init(void) {
 
     pr_info("vbd: INIT\n");
 
-    if (register_blkdev(OVBD_MAJOR, "ovbd")) return -EIO;
+    if (index_bench) lsmt_index_bench(index_bench, 1 << 20);
+    if (codec_bench) zfile_codec_bench(64 * 1024, codec_bench);
+
+    if (zfile_init()) return -ENOMEM;
+    ovbd_debugfs = debugfs_create_dir("vbd", NULL);
+    if (register_blkdev(OVBD_MAJOR, "ovbd")) {
+        debugfs_remove_recursive(ovbd_debugfs);
+        zfile_exit();
+        return -EIO;
+    }
 
     ovbd_check_and_reset_par();
 
@@ -396,6 +939,8 @@ out_free:
         ovbd_free(ovbd);
     }
     unregister_blkdev(OVBD_MAJOR, "ovbd");
+    debugfs_remove_recursive(ovbd_debugfs);
+    zfile_exit();
     pr_info("ovbd: module NOT loaded !!!\n");
     return -ENOMEM;
 }
@@ -409,6 +954,8 @@ static void __exit ovbd_exit(void) {
 
     blk_unregister_region(MKDEV(OVBD_MAJOR, 0), 1UL << MINORBITS);
     unregister_blkdev(OVBD_MAJOR, "ovbd");
+    debugfs_remove_recursive(ovbd_debugfs);
+    zfile_exit();
 
     pr_info("ovbd: module unloaded\n");
 }
@@ -9,7 +9,45 @@
 #include <linux/kthread.h>
 #include <linux/blk-mq.h>
 
+#include "stats.h"
+
+#define OVBD_MAX_SEGMENTS BLK_MAX_SEGMENTS
+
 struct lsmt_file;
+struct zfile_scratch;
+
+/*
+ * One worker per hardware queue, so reads submitted from different CPUs
+ * are served in parallel instead of funnelling through a single thread.
+ */
+struct ovbd_queue {
+	struct kthread_worker	worker;
+	struct task_struct	*worker_task;
+};
+
+#define OVBD_STREAMS 8
+
+/*
+ * A sequential or strided read stream, detected from request positions.
+ * The next request is expected at `last + stride`; each hit doubles the
+ * readahead window, a request landing elsewhere nearby collapses it.
+ * Sequential streams have `stride == len` and read ahead one range.
+ */
+struct ovbd_stream {
+	loff_t		last;		// position of the last request
+	size_t		len;		// its length, 0 if slot is unused
+	loff_t		stride;		// 0 until a second request is seen
+	size_t		window;		// bytes kept read ahead of the stream
+	unsigned long	used;		// to recycle the least recently used
+
+	// readahead of [ra_pos, ra_next) is queued to `work`, which moves
+	// `ra_pos` up as it takes the range
+	struct work_struct	work;
+	struct ovbd_device	*ovbd;
+	loff_t		ra_pos;
+	loff_t		ra_next;
+};
+
 /*
  * Each block ovbd device has a radix_tree ovbd_pages of pages that stores
  * the pages containing the block device's contents. A ovbd page's ->index is
@@ -38,9 +76,23 @@ struct ovbd_device {
         // assume block-dev size is `lsmtfile_len`
 	struct lsmt_file* fp;
  	unsigned char* path;
+	// `ZF_VERIFY_*` asked of the layer, which verifies in the strictest
+	// mode of devices on it
+	int verify;
 
-	struct kthread_worker	worker;
-	struct task_struct	*worker_task;
+	struct ovbd_queue	*queues;
+	unsigned int		nr_queues;
+
+	// protects `streams` and `stream_clock`
+	spinlock_t		stream_lock;
+	struct ovbd_stream	streams[OVBD_STREAMS];
+	unsigned long		stream_clock;
+	// loads lazily loaded metadata after attach, if `warm_index`
+	struct work_struct	warm;
+
+	// requests served, data path stats are kept by the layer zfile
+	struct vbd_stats	stats;
+	struct dentry		*debugfs;
 
         struct blk_mq_tag_set	tag_set;
 	// bool initialized ;
@@ -52,6 +104,19 @@ struct ovbd_cmd {
         long ret;
         struct kiocb iocb;
         struct bio_vec *bvec;
+        // preallocated bvec table of multi-bio requests
+        struct bio_vec *bvecs;
+
+        // async read of compressed data, see `ovbd_read_aio`
+        struct kthread_work aio_work;
+        struct zfile_scratch *scr;
+        // preallocated to cover `zfile_scratch_size`
+        struct bio_vec *cvec;
+        unsigned int nr_cvec;
+        loff_t cbegin;
+        loff_t moffset;
+        u64 fetch_start;  // of the back file read
+        u64 start;        // of the request, `ktime_get_ns`
 };
 
 #endif
@@ -0,0 +1,85 @@
+#include <linux/cpumask.h>
+#include <linux/math64.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "stats.h"
+
+static const char* const vbd_counter_names[VBD_NR_COUNTERS] = {
+    [VBD_REQUESTS] = "requests",
+    [VBD_BYTES] = "bytes",
+    [VBD_FETCHED] = "fetched_bytes",
+    [VBD_DECOMPRESSED] = "decompressed_blocks",
+    [VBD_CACHE_HIT] = "cache_hits",
+    [VBD_CACHE_MISS] = "cache_misses",
+    [VBD_ZERO_BYTES] = "zero_bytes",
+};
+
+static const char* const vbd_latency_names[VBD_NR_LATENCIES] = {
+    [VBD_LAT_REQUEST] = "request",
+    [VBD_LAT_BACKING] = "backing_read",
+    [VBD_LAT_DECOMPRESS] = "decompress",
+    [VBD_LAT_INDEX] = "index_lookup",
+};
+
+int vbd_stats_init(struct vbd_stats* st) {
+    st->cpu = alloc_percpu(struct vbd_stats_cpu);
+    return st->cpu ? 0 : -ENOMEM;
+}
+
+void vbd_stats_destroy(struct vbd_stats* st) {
+    free_percpu(st->cpu);
+    st->cpu = NULL;
+}
+
+void vbd_stats_reset(struct vbd_stats* st) {
+    int cpu;
+
+    if (!st->cpu) return;
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(st->cpu, cpu), 0, sizeof(struct vbd_stats_cpu));
+}
+
+// counters with a value, then for each latency seen: count, average and
+// the histogram up to its last non empty bucket
+void vbd_stats_show(struct seq_file* m, struct vbd_stats* st) {
+    struct vbd_stats_cpu* sum;
+    struct vbd_stats_cpu* c;
+    u64 n;
+    int cpu, i, b, last;
+
+    if (!st->cpu) return;
+    sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum) return;
+    for_each_possible_cpu(cpu) {
+        c = per_cpu_ptr(st->cpu, cpu);
+        for (i = 0; i < VBD_NR_COUNTERS; i++) sum->count[i] += c->count[i];
+        for (i = 0; i < VBD_NR_LATENCIES; i++) {
+            sum->total_ns[i] += c->total_ns[i];
+            for (b = 0; b < VBD_HIST_BUCKETS; b++)
+                sum->hist[i][b] += c->hist[i][b];
+        }
+    }
+    for (i = 0; i < VBD_NR_COUNTERS; i++) {
+        if (sum->count[i])
+            seq_printf(m, "%s: %llu\n", vbd_counter_names[i], sum->count[i]);
+    }
+    n = sum->count[VBD_CACHE_HIT] + sum->count[VBD_CACHE_MISS];
+    if (n)
+        seq_printf(m, "cache_hit_ratio: %llu%%\n",
+                   div64_u64(sum->count[VBD_CACHE_HIT] * 100, n));
+    for (i = 0; i < VBD_NR_LATENCIES; i++) {
+        n = 0;
+        last = 0;
+        for (b = 0; b < VBD_HIST_BUCKETS; b++) {
+            n += sum->hist[i][b];
+            if (sum->hist[i][b]) last = b;
+        }
+        if (!n) continue;
+        seq_printf(m, "%s_ns: count %llu avg %llu log2 histogram",
+                   vbd_latency_names[i], n, div64_u64(sum->total_ns[i], n));
+        for (b = 0; b <= last; b++) seq_printf(m, " %llu", sum->hist[i][b]);
+        seq_putc(m, '\n');
+    }
+    kfree(sum);
+}
@@ -0,0 +1,65 @@
+#ifndef __VBD_STATS_H__
+#define __VBD_STATS_H__
+
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/seq_file.h>
+
+enum vbd_counter {
+    VBD_REQUESTS,      // requests served
+    VBD_BYTES,         // bytes served
+    VBD_FETCHED,       // compressed bytes read from back file
+    VBD_DECOMPRESSED,  // blocks decompressed
+    VBD_CACHE_HIT,     // blocks served from block cache
+    VBD_CACHE_MISS,
+    VBD_ZERO_BYTES,    // of holes and zeroed segments, no back file read
+    VBD_NR_COUNTERS,
+};
+
+enum vbd_latency {
+    VBD_LAT_REQUEST,  // queued to completed
+    VBD_LAT_BACKING,  // read of compressed data from back file
+    VBD_LAT_DECOMPRESS,
+    VBD_LAT_INDEX,  // segment index lookup
+    VBD_NR_LATENCIES,
+};
+
+// bucket `b` of a latency histogram counts [2^(b-1), 2^b) ns, the last one
+// all from 2^30 ns on
+#define VBD_HIST_BUCKETS 32
+
+struct vbd_stats_cpu {
+    u64 count[VBD_NR_COUNTERS];
+    u64 total_ns[VBD_NR_LATENCIES];
+    u64 hist[VBD_NR_LATENCIES][VBD_HIST_BUCKETS];
+};
+
+// counters and latency histograms, per cpu so updates take no lock and
+// share no cache line. they are added up only when shown
+struct vbd_stats {
+    struct vbd_stats_cpu __percpu* cpu;
+};
+
+int vbd_stats_init(struct vbd_stats* st);
+void vbd_stats_destroy(struct vbd_stats* st);
+// zero all counters, updates racing with it may survive
+void vbd_stats_reset(struct vbd_stats* st);
+void vbd_stats_show(struct seq_file* m, struct vbd_stats* st);
+
+static inline void vbd_stat_add(struct vbd_stats* st, enum vbd_counter c,
+                                u64 v) {
+    if (st->cpu) this_cpu_add(st->cpu->count[c], v);
+}
+
+// account time since `start`, taken by `ktime_get_ns`
+static inline void vbd_stat_time(struct vbd_stats* st, enum vbd_latency l,
+                                 u64 start) {
+    u64 ns;
+
+    if (!st->cpu) return;
+    ns = ktime_get_ns() - start;
+    this_cpu_inc(st->cpu->hist[l][min(fls64(ns), VBD_HIST_BUCKETS - 1)]);
+    this_cpu_add(st->cpu->total_ns[l], ns);
+}
+
+#endif
@@ -0,0 +1,234 @@
+// read throughput, index lookup and decompression speed of an lsmtz image,
+// through the same zfile and lsmt code as the kernel module
+#include <shim.h>
+
+#include "lcache.h"
+#include "lsmt.h"
+#include "zfile.h"
+
+static uint64_t bench_rand(uint64_t *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+static double bench_ms(u64 ns) { return ns / 1e6; }
+
+static double bench_mbs(u64 bytes, u64 ns) {
+    return ns ? bytes * 1e3 / ns : 0;
+}
+
+static void bench_stats(struct zfile *zf) {
+    struct seq_file m = {.f = stdout};
+
+    vbd_stats_show(&m, &zf->stats);
+    vbd_stats_reset(&zf->stats);
+}
+
+// read all of `image` in `chunk` pieces into `buf`, returning a hash of it,
+// through local cache file `cache` if not NULL
+static int bench_hash(const char *image, const char *cache, char *buf,
+                      size_t chunk, uint64_t *hash) {
+    struct lsmt_file *fp;
+    struct zfile *zf;
+    struct lcache *lc;
+    u64 t0, vsize, off, i;
+    ssize_t ret;
+
+    fp = lsmt_open(zfile_open(image));
+    if (!fp) return -EIO;
+    zf = lsmt_getzfile(fp);
+    if (cache) {
+        lc = lcache_open(cache, zfile_getfile(zf), (loff_t)1 << 40);
+        if (!lc) {
+            lsmt_close(fp);
+            return -EIO;
+        }
+        printf("lcache: %u of %zu chunks present at open\n",
+               bitmap_weight(lc->bitmap, lc->nr_chunks), lc->nr_chunks);
+        zfile_set_lcache(zf, lc);
+    }
+    vsize = lsmt_len(fp);
+    *hash = 0xcbf29ce484222325ULL;
+    t0 = ktime_get_ns();
+    for (off = 0; off < vsize; off += chunk) {
+        ret = lsmt_read(fp, buf, min((u64)chunk, vsize - off), off);
+        if (ret != min((u64)chunk, vsize - off)) {
+            fprintf(stderr, "read at %llu failed, %zd\n", off, ret);
+            lsmt_close(fp);
+            return -EIO;
+        }
+        for (i = 0; i < ret; i++)
+            *hash = (*hash ^ (unsigned char)buf[i]) * 0x100000001b3ULL;
+    }
+    printf("lcache: %s read %.1f MB/s\n", cache ? cache : "no cache",
+           bench_mbs(vsize, ktime_get_ns() - t0));
+    lsmt_close(fp);
+    return 0;
+}
+
+// round trip through local cache `cache`: fill it, close and reopen it, and
+// read from it, both times matching a read without it
+static int bench_lcache(const char *image, const char *cache, char *buf,
+                        size_t chunk) {
+    uint64_t want, got;
+    int pass;
+
+    if (bench_hash(image, NULL, buf, chunk, &want)) return 1;
+    for (pass = 0; pass < 2; pass++) {
+        if (bench_hash(image, cache, buf, chunk, &got)) return 1;
+        if (got != want) {
+            fprintf(stderr, "lcache: data mismatch in pass %d\n", pass);
+            return 1;
+        }
+    }
+    printf("lcache: round trip ok\n");
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-v] [-o param=value]... [-n reads] [-b bytes] "
+            "[-c cache] image.lsmtz\n"
+            "  -o  set a zfile or lsmt module parameter, e.g. cache_mb=0\n"
+            "  -n  random reads and index lookups, default 100000\n"
+            "  -b  bytes of a random read, default 4096\n"
+            "  -c  check a round trip through local cache file `cache`\n"
+            "      instead, which should not exist\n"
+            "  -v  print kernel log messages\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    size_t nr = 100000, bs = 4096, chunk = 1 << 20;
+    struct lsmt_file *fp;
+    struct zfile *zf;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    u64 t0, ns, vsize, decomp_ns, decomp_blocks;
+    loff_t off, moffset;
+    size_t i, hits = 0;
+    ssize_t ret;
+    char *buf, *eq, *cache = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vo:n:b:c:")) != -1) {
+        switch (opt) {
+            case 'v':
+                shim_verbose = 1;
+                break;
+            case 'o':
+                eq = strchr(optarg, '=');
+                if (!eq) usage(argv[0]);
+                *eq = 0;
+                if (shim_param_set(optarg, eq + 1)) {
+                    fprintf(stderr, "unknown parameter %s\n", optarg);
+                    return 2;
+                }
+                break;
+            case 'n':
+                nr = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                bs = strtoul(optarg, NULL, 0);
+                break;
+            case 'c':
+                cache = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || bs == 0 || bs % SECTOR_SIZE) usage(argv[0]);
+    if (zfile_init()) return 1;
+    if (cache) {
+        buf = malloc(chunk);
+        if (!buf) return 1;
+        ret = bench_lcache(argv[optind], cache, buf, chunk);
+        free(buf);
+        zfile_exit();
+        return ret;
+    }
+
+    t0 = ktime_get_ns();
+    fp = lsmt_open(zfile_open(argv[optind]));
+    if (!fp) {
+        fprintf(stderr, "cannot open %s\n", argv[optind]);
+        return 1;
+    }
+    printf("open: %.3f ms\n", bench_ms(ktime_get_ns() - t0));
+    zf = lsmt_getzfile(fp);
+    vsize = lsmt_len(fp);
+    buf = malloc(max(chunk, bs));
+    if (!buf || vsize < bs) return 1;
+
+    // random lookups, whether they map to a single segment or not
+    t0 = ktime_get_ns();
+    for (i = 0; i < nr; i++) {
+        off = bench_rand(&seed) % (vsize / SECTOR_SIZE) * SECTOR_SIZE;
+        hits += lsmt_map_extent(fp, SECTOR_SIZE, off, &moffset);
+    }
+    ns = ktime_get_ns() - t0;
+    printf("index lookup: %.1f ns/op, %zu of %zu in data segments\n",
+           (double)ns / max(nr, (size_t)1), hits, nr);
+    vbd_stats_reset(&zf->stats);
+
+    t0 = ktime_get_ns();
+    for (off = 0; off < vsize; off += chunk) {
+        ret = lsmt_read(fp, buf, min((u64)chunk, vsize - off), off);
+        if (ret < 0) {
+            fprintf(stderr, "read at %lld failed, %zd\n", off, ret);
+            return 1;
+        }
+    }
+    ns = ktime_get_ns() - t0;
+    printf("sequential read: %.1f MB/s, %llu bytes in %.3f ms\n",
+           bench_mbs(vsize, ns), vsize, bench_ms(ns));
+    decomp_ns = 0;
+    decomp_blocks = 0;
+    decomp_ns += zf->stats.cpu->total_ns[VBD_LAT_DECOMPRESS];
+    decomp_blocks += zf->stats.cpu->count[VBD_DECOMPRESSED];
+    bench_stats(zf);
+
+    t0 = ktime_get_ns();
+    for (i = 0; i < nr; i++) {
+        off = bench_rand(&seed) % (vsize / bs) * bs;
+        ret = lsmt_read(fp, buf, bs, off);
+        if (ret != bs) {
+            fprintf(stderr, "read at %lld failed, %zd\n", off, ret);
+            return 1;
+        }
+    }
+    ns = ktime_get_ns() - t0;
+    printf("random read: %.1f MB/s, %.0f IOPS of %zu bytes\n",
+           bench_mbs(nr * bs, ns), ns ? nr * 1e9 / ns : 0, bs);
+    decomp_ns += zf->stats.cpu->total_ns[VBD_LAT_DECOMPRESS];
+    decomp_blocks += zf->stats.cpu->count[VBD_DECOMPRESSED];
+    bench_stats(zf);
+
+    // the same reads again, as the driver tries them when queued
+    hits = 0;
+    t0 = ktime_get_ns();
+    for (i = 0; i < nr; i++) {
+        struct kvec kv = {.iov_base = buf, .iov_len = bs};
+        struct iov_iter iter;
+
+        off = bench_rand(&seed) % (vsize / bs) * bs;
+        iov_iter_kvec(&iter, READ, &kv, 1, bs);
+        hits += lsmt_read_cached(fp, &iter, bs, off) == bs;
+    }
+    ns = ktime_get_ns() - t0;
+    printf("inline read: %.1f ns/op, %zu of %zu served without blocking\n",
+           (double)ns / max(nr, (size_t)1), hits, nr);
+    vbd_stats_reset(&zf->stats);
+
+    printf("decompress: %.1f MB/s over %llu blocks\n",
+           bench_mbs(decomp_blocks * zf->header.opt.block_size, decomp_ns),
+           decomp_blocks);
+
+    free(buf);
+    lsmt_close(fp);
+    zfile_exit();
+    return 0;
+}
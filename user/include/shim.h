@@ -0,0 +1,527 @@
+// kernel interfaces used by zfile.c, lsmt.c, lcache.c and stats.c, on top
+// of libc, pthreads, liblz4 and libzstd. single threaded where the kernel
+// would spread work over CPUs: one possible CPU, work runs when queued
+#ifndef __VBD_SHIM_H__
+#define __VBD_SHIM_H__
+
+#define _GNU_SOURCE
+// kernel sources get <linux/errno.h> from here as well
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <lz4.h>
+#define ZSTD_STATIC_LINKING_ONLY
+#include <zstd.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef long long s64;
+typedef uint64_t sector_t;
+typedef unsigned int gfp_t;
+typedef unsigned long pgoff_t;
+typedef s64 ktime_t;
+// as in the kernel, where they are u64, s64 and long long, so that format
+// strings of the kernel code check out here as well. system headers are all
+// included above
+#define uint64_t u64
+#define int64_t s64
+#define loff_t long long
+
+#define __user
+#define __percpu
+#define __init
+#define __exit
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define IS_REACHABLE(x) (x)
+#define CONFIG_LZ4_COMPRESS 1
+#define CONFIG_ZSTD_COMPRESS 1
+
+#define GFP_KERNEL 0
+#define GFP_NOIO 0
+#define GFP_ATOMIC 0
+#define NUMA_NO_NODE (-1)
+
+#define U16_MAX ((u16)~0U)
+#define U32_MAX ((u32)~0U)
+#define U64_MAX ((u64)~0ULL)
+#define SECTOR_SHIFT 9
+#define SECTOR_SIZE (1 << SECTOR_SHIFT)
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+#define PAGE_MASK (~(PAGE_SIZE - 1))
+#define PAGE_ALIGN(x) (((x) + PAGE_SIZE - 1) & PAGE_MASK)
+#define offset_in_page(p) ((unsigned long)(p) & ~PAGE_MASK)
+#define BITS_PER_LONG 64
+#define BITS_TO_LONGS(n) (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define GOLDEN_RATIO_64 0x61C8864680B583EBull
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define round_up(x, y) ((((x) - 1) | ((__typeof__(x))(y) - 1)) + 1)
+#define round_down(x, y) ((x) & ~((__typeof__(x))(y) - 1))
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min3(a, b, c) min(min(a, b), c)
+#define min_t(t, a, b) ((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b) ((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+#define clamp_t(t, v, lo, hi) min_t(t, max_t(t, v, lo), hi)
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+#define struct_size(p, member, n) \
+    (sizeof(*(p)) + sizeof((p)->member[0]) * (size_t)(n))
+
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define smp_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define cmpxchg(p, o, n)                                                   \
+    ({                                                                     \
+        __typeof__(*(p)) __old = (o);                                      \
+        __atomic_compare_exchange_n((p), &__old, (n), false,               \
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);   \
+        __old;                                                             \
+    })
+
+#define MAX_ERRNO 4095
+#define IS_ERR_VALUE(x) ((unsigned long)(x) >= (unsigned long)-MAX_ERRNO)
+static inline void *ERR_PTR(long e) { return (void *)e; }
+static inline long PTR_ERR(const void *p) { return (long)p; }
+static inline bool IS_ERR(const void *p) { return IS_ERR_VALUE(p); }
+static inline bool IS_ERR_OR_NULL(const void *p) { return !p || IS_ERR(p); }
+
+// logging, to stderr if `shim_verbose`
+extern int shim_verbose;
+#define printk(fmt, ...) \
+    do { if (shim_verbose) fprintf(stderr, fmt, ##__VA_ARGS__); } while (0)
+#define pr_info printk
+#define pr_debug(fmt, ...) do { } while (0)
+#define WARN_ONCE(cond, fmt, ...)                                         \
+    ({                                                                    \
+        static bool __warned;                                             \
+        bool __c = !!(cond);                                              \
+        if (__c && !__warned) {                                           \
+            __warned = true;                                              \
+            fprintf(stderr, fmt, ##__VA_ARGS__);                          \
+        }                                                                 \
+        __c;                                                              \
+    })
+
+// module parameters can be set by name, see `shim_param_set`
+void shim_param_register(const char *name, void *p, size_t size);
+int shim_param_set(const char *name, const char *value);
+#define module_param(name, type, perm)                                  \
+    static void __attribute__((constructor)) shim_param_##name(void) {   \
+        shim_param_register(#name, &name, sizeof(name));                 \
+    }
+#define MODULE_PARM_DESC(name, desc)
+#define MODULE_LICENSE(x)
+
+// bit operations
+static inline int fls64(u64 x) { return x ? 64 - __builtin_clzll(x) : 0; }
+static inline int ilog2(u64 x) { return fls64(x) - 1; }
+static inline u64 roundup_pow_of_two(u64 x) {
+    return x <= 1 ? 1 : 1ULL << fls64(x - 1);
+}
+static inline u64 hash_long(u64 val, unsigned int bits) {
+    return bits ? val * GOLDEN_RATIO_64 >> (64 - bits) : 0;
+}
+static inline void set_bit(long nr, unsigned long *addr) {
+    __atomic_fetch_or(&addr[nr / BITS_PER_LONG], 1UL << (nr % BITS_PER_LONG),
+                      __ATOMIC_RELAXED);
+}
+static inline bool test_bit(long nr, const unsigned long *addr) {
+    return (__atomic_load_n(&addr[nr / BITS_PER_LONG], __ATOMIC_RELAXED) >>
+            (nr % BITS_PER_LONG)) & 1;
+}
+static inline void bitmap_zero(unsigned long *dst, unsigned int nbits) {
+    memset(dst, 0, BITS_TO_LONGS(nbits) * sizeof(unsigned long));
+}
+static inline unsigned int bitmap_weight(const unsigned long *src,
+                                         unsigned int nbits) {
+    unsigned int i, w = 0;
+
+    for (i = 0; i < nbits; i++) w += test_bit(i, src);
+    return w;
+}
+static inline u32 get_unaligned_le32(const void *p) {
+    u32 v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+static inline void put_unaligned_le32(u32 v, void *p) {
+    memcpy(p, &v, sizeof(v));
+}
+static inline u64 div64_u64(u64 a, u64 b) { return a / b; }
+u32 crc32c(u32 crc, const void *p, size_t len);
+
+// lists
+struct list_head {
+    struct list_head *next, *prev;
+};
+struct hlist_head {
+    struct hlist_node *first;
+};
+struct hlist_node {
+    struct hlist_node *next, **pprev;
+};
+#define LIST_HEAD_INIT(name) {&(name), &(name)}
+#define LIST_HEAD(name) struct list_head name = LIST_HEAD_INIT(name)
+static inline void INIT_LIST_HEAD(struct list_head *l) { l->next = l->prev = l; }
+static inline void __list_add(struct list_head *n, struct list_head *prev,
+                              struct list_head *next) {
+    next->prev = n;
+    n->next = next;
+    n->prev = prev;
+    prev->next = n;
+}
+static inline void list_add(struct list_head *n, struct list_head *h) {
+    __list_add(n, h, h->next);
+}
+static inline void list_add_tail(struct list_head *n, struct list_head *h) {
+    __list_add(n, h->prev, h);
+}
+static inline void list_del(struct list_head *e) {
+    e->next->prev = e->prev;
+    e->prev->next = e->next;
+    e->next = e->prev = NULL;
+}
+static inline void list_del_init(struct list_head *e) {
+    list_del(e);
+    INIT_LIST_HEAD(e);
+}
+static inline void list_move(struct list_head *e, struct list_head *h) {
+    list_del(e);
+    list_add(e, h);
+}
+static inline bool list_empty(const struct list_head *h) {
+    return h->next == h;
+}
+#define list_empty_careful(h) list_empty(h)
+#define list_entry(p, type, member) container_of(p, type, member)
+#define list_first_entry(h, type, member) list_entry((h)->next, type, member)
+#define list_last_entry(h, type, member) list_entry((h)->prev, type, member)
+#define list_first_entry_or_null(h, type, member) \
+    (list_empty(h) ? NULL : list_first_entry(h, type, member))
+#define list_next_entry(p, member) \
+    list_entry((p)->member.next, __typeof__(*(p)), member)
+#define list_for_each_entry(p, h, member)                       \
+    for (p = list_first_entry(h, __typeof__(*p), member);       \
+         &p->member != (h); p = list_next_entry(p, member))
+#define list_for_each_entry_safe(p, n, h, member)                 \
+    for (p = list_first_entry(h, __typeof__(*p), member),         \
+        n = list_next_entry(p, member);                           \
+         &p->member != (h); p = n, n = list_next_entry(n, member))
+#define INIT_HLIST_HEAD(h) ((h)->first = NULL)
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h) {
+    n->next = h->first;
+    if (h->first) h->first->pprev = &n->next;
+    h->first = n;
+    n->pprev = &h->first;
+}
+static inline void hlist_del(struct hlist_node *n) {
+    *n->pprev = n->next;
+    if (n->next) n->next->pprev = n->pprev;
+}
+#define hlist_entry_safe(p, type, member) \
+    ({ __typeof__(p) __p = (p); __p ? container_of(__p, type, member) : NULL; })
+#define hlist_for_each_entry(p, h, member)                                  \
+    for (p = hlist_entry_safe((h)->first, __typeof__(*p), member); p;       \
+         p = hlist_entry_safe(p->member.next, __typeof__(*p), member))
+
+// memory
+static inline void *kmalloc(size_t size, gfp_t gfp) { return malloc(size); }
+static inline void *kzalloc(size_t size, gfp_t gfp) { return calloc(1, size); }
+static inline void *kmalloc_array(size_t n, size_t size, gfp_t gfp) {
+    return malloc(n * size);
+}
+static inline void *kcalloc(size_t n, size_t size, gfp_t gfp) {
+    return calloc(n, size);
+}
+static inline void kfree(const void *p) { free((void *)p); }
+#define vmalloc(size) malloc(size)
+#define vzalloc(size) calloc(1, size)
+#define vfree(p) free(p)
+#define kvmalloc(size, gfp) malloc(size)
+#define kvmalloc_array(n, size, gfp) malloc((n) * (size))
+#define kvfree(p) free((void *)(p))
+
+// the back file has no page cache to map, zfile reads it into buffers
+struct file;
+struct page;
+struct address_space {
+    const struct address_space_operations {
+        int (*readpage)(struct file *, struct page *);
+    } * a_ops;
+};
+static inline int PageHighMem(struct page *p) { return 0; }
+static inline void *page_address(struct page *p) { return NULL; }
+static inline void put_page(struct page *p) {}
+static inline struct page *read_cache_page(struct address_space *m,
+                                           pgoff_t index, void *filler,
+                                           void *data) {
+    return ERR_PTR(-EIO);
+}
+static inline void *vm_map_ram(struct page **pages, unsigned int n, int node) {
+    return NULL;
+}
+static inline void vm_unmap_ram(const void *mem, unsigned int n) {}
+
+// files
+struct timespec64 {
+    s64 tv_sec;
+    long tv_nsec;
+};
+struct super_block {
+    dev_t s_dev;
+};
+struct inode {
+    loff_t i_size;
+    unsigned long i_ino;
+    struct timespec64 i_mtime;
+    struct super_block *i_sb;
+    struct super_block sb;
+};
+struct path {
+    const char *name;
+};
+struct file {
+    int fd;
+    struct inode *f_inode;
+    struct inode inode;
+    struct address_space *f_mapping;
+    struct path f_path;
+};
+static inline struct inode *file_inode(const struct file *f) {
+    return f->f_inode;
+}
+static inline loff_t i_size_read(const struct inode *inode) {
+    return inode->i_size;
+}
+struct file *filp_open(const char *path, int flags, unsigned short mode);
+int filp_close(struct file *file, void *id);
+ssize_t kernel_read(struct file *file, void *buf, size_t count, loff_t *pos);
+ssize_t kernel_write(struct file *file, const void *buf, size_t count,
+                     loff_t *pos);
+int vfs_fsync(struct file *file, int datasync);
+
+// iov_iter over kernel buffers only
+struct kvec {
+    void *iov_base;
+    size_t iov_len;
+};
+struct bio_vec {
+    struct page *bv_page;
+    unsigned int bv_len;
+    unsigned int bv_offset;
+};
+struct iov_iter {
+    const struct kvec *kvec;
+    const struct bio_vec *bvec;
+    unsigned long nr_segs;
+    size_t iov_offset;
+    size_t count;
+};
+#define READ 0
+void iov_iter_kvec(struct iov_iter *i, unsigned int direction,
+                   const struct kvec *kvec, unsigned long nr_segs,
+                   size_t count);
+static inline bool iov_iter_is_kvec(const struct iov_iter *i) { return true; }
+static inline bool iov_iter_is_bvec(const struct iov_iter *i) { return false; }
+static inline size_t iov_iter_count(const struct iov_iter *i) {
+    return i->count;
+}
+size_t copy_to_iter(const void *addr, size_t bytes, struct iov_iter *i);
+size_t iov_iter_zero(size_t bytes, struct iov_iter *i);
+void iov_iter_advance(struct iov_iter *i, size_t bytes);
+
+// locking
+typedef pthread_mutex_t spinlock_t;
+struct mutex {
+    pthread_mutex_t m;
+};
+#define DEFINE_MUTEX(name) struct mutex name = {PTHREAD_MUTEX_INITIALIZER}
+#define spin_lock_init(l) pthread_mutex_init((l), NULL)
+#define spin_lock(l) pthread_mutex_lock(l)
+#define spin_unlock(l) pthread_mutex_unlock(l)
+#define mutex_init(l) pthread_mutex_init(&(l)->m, NULL)
+#define mutex_lock(l) pthread_mutex_lock(&(l)->m)
+#define mutex_unlock(l) pthread_mutex_unlock(&(l)->m)
+#define mutex_trylock(l) (!pthread_mutex_trylock(&(l)->m))
+
+typedef struct {
+    int counter;
+} atomic_t;
+#define atomic_set(a, v) __atomic_store_n(&(a)->counter, (v), __ATOMIC_SEQ_CST)
+#define atomic_inc(a) __atomic_add_fetch(&(a)->counter, 1, __ATOMIC_SEQ_CST)
+#define atomic_add_return(v, a) \
+    __atomic_add_fetch(&(a)->counter, (v), __ATOMIC_SEQ_CST)
+#define atomic_dec_and_test(a) \
+    (__atomic_sub_fetch(&(a)->counter, 1, __ATOMIC_SEQ_CST) == 0)
+
+struct kref {
+    atomic_t refcount;
+};
+static inline void kref_init(struct kref *k) { atomic_set(&k->refcount, 1); }
+static inline void kref_get(struct kref *k) {
+    __atomic_add_fetch(&k->refcount.counter, 1, __ATOMIC_SEQ_CST);
+}
+// `release` is called with `lock` held, and unlocks it
+static inline int kref_put_mutex(struct kref *k,
+                                 void (*release)(struct kref *),
+                                 struct mutex *lock) {
+    mutex_lock(lock);
+    if (!atomic_dec_and_test(&k->refcount)) {
+        mutex_unlock(lock);
+        return 0;
+    }
+    release(k);
+    return 1;
+}
+
+// one cpu, work runs when queued, completions are flags
+#define num_possible_cpus() 1
+#define num_online_cpus() 1
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define alloc_percpu(type) ((type *)calloc(1, sizeof(type)))
+#define free_percpu(p) free(p)
+#define per_cpu_ptr(p, cpu) (p)
+#define this_cpu_add(x, v) ((x) += (v))
+#define this_cpu_inc(x) ((x)++)
+
+// allocations have no I/O to recurse into
+#define memalloc_noio_save() 0U
+#define memalloc_noio_restore(flags) ((void)(flags))
+
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *);
+struct work_struct {
+    work_func_t func;
+};
+struct workqueue_struct {
+    int unused;
+};
+#define WQ_UNBOUND 0
+#define WQ_MEM_RECLAIM 0
+#define INIT_WORK(w, f) ((w)->func = (f))
+#define INIT_WORK_ONSTACK INIT_WORK
+#define destroy_work_on_stack(w) do { } while (0)
+static inline struct workqueue_struct *alloc_workqueue(const char *fmt,
+                                                       unsigned int flags,
+                                                       int max) {
+    static struct workqueue_struct wq;
+    return &wq;
+}
+static inline void destroy_workqueue(struct workqueue_struct *wq) {}
+static inline bool queue_work(struct workqueue_struct *wq,
+                              struct work_struct *w) {
+    w->func(w);
+    return true;
+}
+
+struct completion {
+    int done;
+};
+#define DECLARE_COMPLETION_ONSTACK(c) struct completion c = {0}
+static inline void complete(struct completion *c) { c->done = 1; }
+static inline void wait_for_completion(struct completion *c) {}
+
+// wait queues over a condition variable
+typedef struct {
+    pthread_mutex_t m;
+    pthread_cond_t c;
+} wait_queue_head_t;
+#define init_waitqueue_head(w) \
+    (pthread_mutex_init(&(w)->m, NULL), pthread_cond_init(&(w)->c, NULL))
+#define wait_event(w, cond)                                       \
+    do {                                                          \
+        pthread_mutex_lock(&(w).m);                               \
+        while (!(cond)) pthread_cond_wait(&(w).c, &(w).m);        \
+        pthread_mutex_unlock(&(w).m);                             \
+    } while (0)
+#define wake_up(w)                           \
+    do {                                     \
+        pthread_mutex_lock(&(w)->m);         \
+        pthread_cond_broadcast(&(w)->c);     \
+        pthread_mutex_unlock(&(w)->m);       \
+    } while (0)
+
+static inline u64 ktime_get_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#define ktime_get() ((ktime_t)ktime_get_ns())
+
+// uuid
+typedef struct {
+    u8 b[16];
+} uuid_t;
+#define UUID_INIT(a, b, c, d0, d1, d2, d3, d4, d5, d6, d7)               \
+    ((uuid_t){{((a) >> 24) & 0xff, ((a) >> 16) & 0xff, ((a) >> 8) & 0xff, \
+               (a) & 0xff, ((b) >> 8) & 0xff, (b) & 0xff,                 \
+               ((c) >> 8) & 0xff, (c) & 0xff, (d0), (d1), (d2), (d3),     \
+               (d4), (d5), (d6), (d7)}})
+static inline bool uuid_equal(const uuid_t *a, const uuid_t *b) {
+    return !memcmp(a, b, sizeof(uuid_t));
+}
+
+// seq_file over stdio
+struct seq_file {
+    FILE *f;
+};
+#define seq_printf(m, fmt, ...) fprintf((m)->f, fmt, ##__VA_ARGS__)
+#define seq_puts(m, s) fputs((s), (m)->f)
+#define seq_putc(m, c) fputc((c), (m)->f)
+
+// kernel lz4 takes a work memory for compression
+#define LZ4_MEM_COMPRESS LZ4_compressBound(0)
+#define LZ4_compress_default(src, dst, len, cap, wrkmem) \
+    LZ4_compress_default((const char *)(src), (char *)(dst), (len), (cap))
+
+// kernel zstd works in caller provided workspaces
+#define ZSTD_DCtxWorkspaceBound() ZSTD_estimateDCtxSize()
+#define ZSTD_initDCtx(ws, size) ZSTD_initStaticDCtx((ws), (size))
+#define ZSTD_DDictWorkspaceBound() ZSTD_estimateDDictSize(0, ZSTD_dlm_byRef)
+#define ZSTD_initDDict(dict, size, ws, ws_size)                        \
+    ((ZSTD_DDict *)ZSTD_initStaticDDict((ws), (ws_size), (dict), (size), \
+                                        ZSTD_dlm_byRef, ZSTD_dct_auto))
+#define ZSTD_CCtxWorkspaceBound(cparams) \
+    ZSTD_estimateCCtxSize_usingCParams(cparams)
+#define ZSTD_initCCtx(ws, size) ZSTD_initStaticCCtx((ws), (size))
+#define ZSTD_compressCCtx(cctx, dst, cap, src, len, params)          \
+    ({                                                               \
+        size_t __r = ZSTD_CCtx_setParams((cctx), (params));          \
+        if (!ZSTD_isError(__r))                                      \
+            __r = ZSTD_compress2((cctx), (dst), (cap), (src), (len)); \
+        __r;                                                         \
+    })
+
+// tracepoints compile to nothing
+struct request;
+#define TP_PROTO(...) __VA_ARGS__
+#define TP_ARGS(...) __VA_ARGS__
+#define DECLARE_EVENT_CLASS(name, proto, args, tstruct, assign, print)
+#define DEFINE_EVENT(template, name, proto, args) \
+    static inline void trace_##name(proto) {}
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) \
+    static inline void trace_##name(proto) {}
+
+#endif
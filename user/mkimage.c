@@ -0,0 +1,676 @@
+// build an lsmtz image, an LSMT layer compressed into a zfile, out of a raw
+// image or synthetic data. blocks are compressed by a pool of threads and
+// written in order, zero filled ranges become `zeroed` segments and holes of
+// a sparse input are left unmapped
+#include <shim.h>
+
+#include <getopt.h>
+
+#include "lsmt.h"
+#include "zfile.h"
+
+// layout constants and magic of zfile.c and lsmt.c
+#define ZF_SPACE 512
+#define ZF_DICT_MAX (16 * 1024 * 1024)
+#define HT_SPACE 4096
+#define HT_FLAG_HEADER (1 << 0)
+#define HT_FLAG_TYPE (1 << 1)
+#define HT_FLAG_SEALED (1 << 2)
+static const uuid_t ZF_MAGIC1 = UUID_INIT(0x74756a69, 0x2e79, 0x7966, 0x40,
+                                          0x41, 0x6c, 0x69, 0x62, 0x61, 0x62,
+                                          0x61);
+static const uuid_t LSMT_MAGIC1 = UUID_INIT(0x657e63d2, 0x9444, 0x084c, 0xa2,
+                                            0xd2, 0xc8, 0xec, 0x4f, 0xcf, 0xae,
+                                            0x8a);
+
+// zero detection granularity, and longest segment kept aligned to it
+#define MK_CHUNK 4096
+#define MK_SEG_MAX (((1 << 14) - 1) & ~(MK_CHUNK / SECTOR_SIZE - 1))
+// blocks a worker compresses at a time
+#define MK_BATCH 64
+
+// a run of the LSMT stream, in sectors. data runs are stored in the order
+// of `moffset`, which is their position in the stream
+struct mk_seg {
+    uint64_t offset;
+    uint64_t moffset;
+    uint32_t length;
+    bool zeroed;
+};
+
+// a batch of compressed blocks waiting to be written, see `mk_worker`
+struct mk_slot {
+    size_t batch;  // batch it takes next
+    bool done;
+    unsigned char *out;
+    uint32_t sizes[MK_BATCH];
+    size_t len;
+};
+
+static struct {
+    int fd;            // input, -1 for synthetic data
+    uint64_t in_size;  // bytes
+    uint64_t vsize;    // of the layer, in sectors
+    bool keep_zero;
+
+    struct mk_seg *segs;  // by offset, what goes to the index
+    size_t nr_segs, cap_segs;
+    struct mk_seg **layout;  // data segments by moffset
+    size_t nr_layout;
+
+    // LSMT stream in bytes
+    uint64_t data_end, index_offset, trailer_offset, stream_size;
+    struct segment_mapping *index;
+
+    uint8_t type, level;
+    bool verify;
+    uint32_t block_size;
+    void *dict;
+    size_t dict_size;
+    ZSTD_CDict *cdict;
+
+    size_t nr_blocks, nr_batches;
+    struct mk_slot *slots;
+    size_t nr_slots, next_batch;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} mk = {.fd = -1,
+        .type = ZF_CODEC_LZ4,
+        .block_size = 4096,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .cond = PTHREAD_COND_INITIALIZER};
+
+static void die(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    exit(1);
+}
+
+static void *xmalloc(size_t size) {
+    void *p = malloc(size ? size : 1);
+
+    if (!p) die("out of memory\n");
+    return p;
+}
+
+static uint64_t mk_rand(uint64_t *x) {
+    *x ^= *x << 13;
+    *x ^= *x >> 7;
+    *x ^= *x << 17;
+    return *x;
+}
+
+// synthetic content of chunk `c`: a quarter of chunks are zero, the rest
+// runs of a few letters, compressing about 2:1
+static void mk_synth_chunk(unsigned char *buf, uint64_t c) {
+    uint64_t x = (c + 1) * 0x9e3779b97f4a7c15ULL, v;
+    size_t i = 0, n;
+
+    if (mk_rand(&x) % 4 == 0) {
+        memset(buf, 0, MK_CHUNK);
+        return;
+    }
+    while (i < MK_CHUNK) {
+        v = mk_rand(&x);
+        n = min_t(size_t, (v >> 8) % 8 + 1, MK_CHUNK - i);
+        memset(buf + i, 'a' + v % 16, n);
+        i += n;
+    }
+}
+
+// read input bytes [off, off + len), zero past its end
+static void mk_input_read(unsigned char *buf, size_t len, uint64_t off) {
+    unsigned char chunk[MK_CHUNK];
+    size_t n, skip;
+    ssize_t ret;
+
+    if (mk.fd < 0) {
+        while (len) {
+            skip = off % MK_CHUNK;
+            n = min_t(size_t, len, MK_CHUNK - skip);
+            mk_synth_chunk(chunk, off / MK_CHUNK);
+            memcpy(buf, chunk + skip, n);
+            buf += n;
+            off += n;
+            len -= n;
+        }
+        return;
+    }
+    while (len) {
+        n = off < mk.in_size ? min_t(uint64_t, len, mk.in_size - off) : 0;
+        if (n == 0) {
+            memset(buf, 0, len);
+            return;
+        }
+        ret = pread(mk.fd, buf, n, off);
+        if (ret <= 0) die("read input at %llu: %s\n", off, strerror(errno));
+        buf += ret;
+        off += ret;
+        len -= ret;
+    }
+}
+
+static bool mk_is_zero(const unsigned char *p, size_t len) {
+    return p[0] == 0 && !memcmp(p, p + 1, len - 1);
+}
+
+static struct mk_seg *mk_seg_add(void) {
+    if (mk.nr_segs == mk.cap_segs) {
+        mk.cap_segs = mk.cap_segs ? mk.cap_segs * 2 : 1024;
+        mk.segs = realloc(mk.segs, mk.cap_segs * sizeof(struct mk_seg));
+        if (!mk.segs) die("out of memory\n");
+    }
+    return memset(&mk.segs[mk.nr_segs++], 0, sizeof(struct mk_seg));
+}
+
+// append sectors [offset, offset + length) of one kind, merged with the
+// previous segment if they are adjacent
+static void mk_extend(uint64_t offset, uint32_t length, bool zeroed) {
+    struct mk_seg *s = mk.nr_segs ? &mk.segs[mk.nr_segs - 1] : NULL;
+    uint32_t n;
+
+    while (length) {
+        if (!s || s->zeroed != zeroed || s->offset + s->length != offset ||
+            s->length == MK_SEG_MAX) {
+            s = mk_seg_add();
+            s->offset = offset;
+            s->zeroed = zeroed;
+        }
+        n = min_t(uint32_t, length, MK_SEG_MAX - s->length);
+        s->length += n;
+        offset += n;
+        length -= n;
+    }
+}
+
+// scan input range [begin, end) in bytes for zero filled chunks
+static void mk_scan(uint64_t begin, uint64_t end) {
+    const size_t bufsize = 1 << 20;
+    unsigned char *buf = xmalloc(bufsize);
+    size_t n, i, len;
+
+    while (begin < end) {
+        n = min_t(uint64_t, bufsize, end - begin);
+        mk_input_read(buf, n, begin);
+        for (i = 0; i < n; i += len) {
+            len = min_t(size_t, MK_CHUNK - (begin + i) % MK_CHUNK, n - i);
+            mk_extend((begin + i) / SECTOR_SIZE, DIV_ROUND_UP(len, SECTOR_SIZE),
+                      !mk.keep_zero && mk_is_zero(buf + i, len));
+        }
+        begin += n;
+    }
+    free(buf);
+}
+
+// segments of the whole input, skipping holes of a sparse file. data of the
+// last partial sector is padded with zero
+static void mk_build_segments(void) {
+    uint64_t end = mk.vsize * SECTOR_SIZE;
+    off_t data, hole;
+
+    if (mk.fd < 0) {
+        mk_scan(0, end);
+        return;
+    }
+    for (data = 0; (uint64_t)data < mk.in_size; data = hole) {
+        data = lseek(mk.fd, data, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) break;
+            // not supported, take all as data
+            mk_scan(0, end);
+            return;
+        }
+        hole = lseek(mk.fd, data, SEEK_HOLE);
+        if (hole < 0) hole = mk.in_size;
+        data = round_down(data, SECTOR_SIZE);
+        mk_scan(data, (uint64_t)hole >= mk.in_size ? end
+                                                  : round_up(hole, SECTOR_SIZE));
+    }
+}
+
+// split segments into about `target` pieces of equal length, for an index
+// of that size
+static void mk_fragment(size_t target) {
+    struct mk_seg *old = mk.segs;
+    size_t nr = mk.nr_segs, i;
+    uint64_t mapped = 0, piece, off;
+    uint32_t n;
+
+    for (i = 0; i < nr; i++) mapped += old[i].length;
+    if (!target || !mapped) return;
+    piece = max_t(uint64_t, mapped / target, 1);
+    mk.segs = NULL;
+    mk.nr_segs = mk.cap_segs = 0;
+    for (i = 0; i < nr; i++) {
+        for (off = 0; off < old[i].length; off += n) {
+            n = min_t(uint64_t, piece, old[i].length - off);
+            *mk_seg_add() = (struct mk_seg){.offset = old[i].offset + off,
+                                            .length = n,
+                                            .zeroed = old[i].zeroed};
+        }
+    }
+    free(old);
+}
+
+// give data segments their place in the stream, in offset order or shuffled,
+// and the LSMT index and trailer their place after them
+static void mk_layout(bool shuffle) {
+    uint64_t x = 0x2545f4914f6cdd1dULL, moffset = HT_SPACE / SECTOR_SIZE;
+    struct mk_seg *t;
+    size_t i, j;
+
+    mk.layout = xmalloc(mk.nr_segs * sizeof(struct mk_seg *));
+    for (i = 0; i < mk.nr_segs; i++)
+        if (!mk.segs[i].zeroed) mk.layout[mk.nr_layout++] = &mk.segs[i];
+    for (i = mk.nr_layout; shuffle && i > 1; i--) {
+        j = mk_rand(&x) % i;
+        t = mk.layout[i - 1];
+        mk.layout[i - 1] = mk.layout[j];
+        mk.layout[j] = t;
+    }
+    for (i = 0; i < mk.nr_layout; i++) {
+        mk.layout[i]->moffset = moffset;
+        moffset += mk.layout[i]->length;
+    }
+    mk.data_end = moffset * SECTOR_SIZE;
+    mk.index_offset = round_up(mk.data_end, (uint64_t)HT_SPACE);
+    mk.trailer_offset =
+        round_up(mk.index_offset +
+                     mk.nr_segs * sizeof(struct segment_mapping),
+                 (uint64_t)HT_SPACE);
+    mk.stream_size = mk.trailer_offset + HT_SPACE;
+
+    mk.index = xmalloc(mk.nr_segs * sizeof(struct segment_mapping));
+    memset(mk.index, 0, mk.nr_segs * sizeof(struct segment_mapping));
+    for (i = 0; i < mk.nr_segs; i++) {
+        mk.index[i].offset = mk.segs[i].offset;
+        mk.index[i].length = mk.segs[i].length;
+        mk.index[i].moffset = mk.segs[i].zeroed ? 0 : mk.segs[i].moffset;
+        mk.index[i].zeroed = mk.segs[i].zeroed;
+    }
+}
+
+static void mk_lsmt_ht(struct lsmt_ht *ht, bool header) {
+    memset(ht, 0, sizeof(*ht));
+    memcpy(&ht->magic0, "LSMT\0\1\2", sizeof(ht->magic0));
+    ht->magic1 = LSMT_MAGIC1;
+    ht->size = sizeof(*ht);
+    ht->flags = header ? HT_FLAG_HEADER : HT_FLAG_SEALED;
+    ht->virtual_size = mk.vsize * SECTOR_SIZE;
+    if (header) return;
+    ht->index_offset = mk.index_offset;
+    ht->index_size = mk.nr_segs;
+}
+
+// bytes [pos, pos + len) of the LSMT stream: header, data segments by
+// moffset, index and trailer, zero in between
+static void mk_stream_read(unsigned char *buf, size_t len, uint64_t pos) {
+    uint64_t end = pos + len, from, to, seg_pos;
+    struct lsmt_ht ht;
+    size_t lo, hi, mid;
+    struct mk_seg *s;
+
+    memset(buf, 0, len);
+    if (pos < sizeof(ht)) {
+        mk_lsmt_ht(&ht, true);
+        memcpy(buf, (char *)&ht + pos, min_t(uint64_t, len, sizeof(ht) - pos));
+    }
+    if (pos < mk.data_end && end > HT_SPACE) {
+        // first data segment ending after `pos`
+        lo = 0;
+        hi = mk.nr_layout;
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            s = mk.layout[mid];
+            if ((s->moffset + s->length) * SECTOR_SIZE <= pos)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        for (; lo < mk.nr_layout; lo++) {
+            s = mk.layout[lo];
+            seg_pos = s->moffset * SECTOR_SIZE;
+            if (seg_pos >= end) break;
+            from = max_t(uint64_t, pos, seg_pos);
+            to = min_t(uint64_t, end, seg_pos + s->length * SECTOR_SIZE);
+            mk_input_read(buf + (from - pos), to - from,
+                          s->offset * SECTOR_SIZE + (from - seg_pos));
+        }
+    }
+    from = max_t(uint64_t, pos, mk.index_offset);
+    to = min_t(uint64_t, end,
+               mk.index_offset + mk.nr_segs * sizeof(struct segment_mapping));
+    if (from < to)
+        memcpy(buf + (from - pos),
+               (char *)mk.index + (from - mk.index_offset), to - from);
+    if (end > mk.trailer_offset && pos < mk.trailer_offset + sizeof(ht)) {
+        mk_lsmt_ht(&ht, false);
+        from = max_t(uint64_t, pos, mk.trailer_offset);
+        to = min_t(uint64_t, end, mk.trailer_offset + sizeof(ht));
+        memcpy(buf + (from - pos), (char *)&ht + (from - mk.trailer_offset),
+               to - from);
+    }
+}
+
+static size_t mk_block_bound(void) {
+    size_t bound = max_t(size_t, LZ4_compressBound(mk.block_size),
+                         ZSTD_compressBound(mk.block_size));
+
+    return bound + sizeof(uint32_t);
+}
+
+struct mk_ctx {
+    unsigned char *src;
+    LZ4_stream_t *lz4;
+    ZSTD_CCtx *cctx;
+};
+
+// compress `len` bytes of `src` to `dst`, with crc32c appended if verify
+static size_t mk_compress(struct mk_ctx *c, unsigned char *dst, size_t len) {
+    size_t cap = mk_block_bound() - sizeof(uint32_t), ret;
+    int n;
+
+    if (mk.type == ZF_CODEC_ZSTD) {
+        if (mk.cdict)
+            ret = ZSTD_compress_usingCDict(c->cctx, dst, cap, c->src, len,
+                                           mk.cdict);
+        else
+            ret = ZSTD_compress_usingDict(c->cctx, dst, cap, c->src, len,
+                                          NULL, 0, mk.level);
+        if (ZSTD_isError(ret))
+            die("zstd: %s\n", ZSTD_getErrorName(ret));
+    } else {
+        LZ4_resetStream_fast(c->lz4);
+        if (mk.dict) LZ4_loadDict(c->lz4, mk.dict, mk.dict_size);
+        n = LZ4_compress_fast_continue(c->lz4, (const char *)c->src,
+                                       (char *)dst, len, cap, 1);
+        if (n <= 0) die("lz4 failed\n");
+        ret = n;
+    }
+    if (mk.verify) {
+        put_unaligned_le32(~crc32c(~0U, dst, ret), dst + ret);
+        ret += sizeof(uint32_t);
+    }
+    return ret;
+}
+
+// takes batches in turn, each into slot `batch % nr_slots` once the writer
+// freed it
+static void *mk_worker(void *arg) {
+    struct mk_ctx c = {0};
+    struct mk_slot *slot;
+    size_t b, i, idx, len;
+    uint64_t pos;
+
+    c.src = xmalloc(mk.block_size);
+    c.lz4 = LZ4_createStream();
+    c.cctx = ZSTD_createCCtx();
+    if (!c.lz4 || !c.cctx) die("out of memory\n");
+    for (;;) {
+        pthread_mutex_lock(&mk.lock);
+        b = mk.next_batch++;
+        slot = &mk.slots[b % mk.nr_slots];
+        while (b < mk.nr_batches && slot->batch != b)
+            pthread_cond_wait(&mk.cond, &mk.lock);
+        pthread_mutex_unlock(&mk.lock);
+        if (b >= mk.nr_batches) break;
+
+        slot->len = 0;
+        for (i = 0; i < MK_BATCH; i++) {
+            idx = b * MK_BATCH + i;
+            if (idx >= mk.nr_blocks) break;
+            pos = (uint64_t)idx * mk.block_size;
+            len = min_t(uint64_t, mk.block_size, mk.stream_size - pos);
+            mk_stream_read(c.src, len, pos);
+            slot->sizes[i] = mk_compress(&c, slot->out + slot->len, len);
+            slot->len += slot->sizes[i];
+        }
+
+        pthread_mutex_lock(&mk.lock);
+        slot->done = true;
+        pthread_cond_broadcast(&mk.cond);
+        pthread_mutex_unlock(&mk.lock);
+    }
+    free(c.src);
+    LZ4_freeStream(c.lz4);
+    ZSTD_freeCCtx(c.cctx);
+    return arg;
+}
+
+static void mk_write(int fd, const void *buf, size_t len, uint64_t off) {
+    ssize_t ret;
+
+    while (len) {
+        ret = pwrite(fd, buf, len, off);
+        if (ret <= 0) die("write output: %s\n", strerror(errno));
+        buf = (const char *)buf + ret;
+        off += ret;
+        len -= ret;
+    }
+}
+
+static void mk_zfile_ht(struct zfile_ht *ht, bool header, uint64_t jump) {
+    memset(ht, 0, sizeof(*ht));
+    memcpy(&ht->magic0, "ZFile\0\1", sizeof(ht->magic0));
+    ht->magic1 = ZF_MAGIC1;
+    ht->size_ht = sizeof(*ht);
+    ht->flags = HT_FLAG_TYPE | (header ? HT_FLAG_HEADER : HT_FLAG_SEALED);
+    ht->opt.block_size = mk.block_size;
+    ht->opt.type = mk.type;
+    ht->opt.level = mk.level;
+    ht->opt.use_dict = mk.dict != NULL;
+    ht->opt.dict_size = mk.dict_size;
+    ht->opt.verify = mk.verify;
+    if (header) return;
+    ht->index_offset = jump;
+    ht->index_size = mk.nr_blocks;
+    ht->vsize = mk.stream_size;
+}
+
+// compress the LSMT stream into zfile `fd` with `threads` workers: header,
+// dictionary, blocks, jump table of their sizes and trailer
+static uint64_t mk_zfile(int fd, int threads) {
+    unsigned char space[ZF_SPACE] = {0};
+    uint32_t *jump;
+    uint64_t pos = ZF_SPACE;
+    pthread_t *tids;
+    struct mk_slot *slot;
+    size_t b, i;
+
+    mk.nr_blocks = DIV_ROUND_UP(mk.stream_size, mk.block_size);
+    mk.nr_batches = DIV_ROUND_UP(mk.nr_blocks, MK_BATCH);
+    mk.nr_slots = threads * 2;
+    mk.slots = xmalloc(mk.nr_slots * sizeof(struct mk_slot));
+    for (i = 0; i < mk.nr_slots; i++) {
+        mk.slots[i] = (struct mk_slot){.batch = i};
+        mk.slots[i].out = xmalloc(MK_BATCH * mk_block_bound());
+    }
+    jump = xmalloc(mk.nr_blocks * sizeof(uint32_t));
+
+    mk_zfile_ht((struct zfile_ht *)space, true, 0);
+    mk_write(fd, space, ZF_SPACE, 0);
+    if (mk.dict) {
+        mk_write(fd, mk.dict, mk.dict_size, pos);
+        pos += mk.dict_size;
+    }
+
+    tids = xmalloc(threads * sizeof(pthread_t));
+    for (i = 0; i < (size_t)threads; i++)
+        if (pthread_create(&tids[i], NULL, mk_worker, NULL))
+            die("failed to start threads\n");
+    for (b = 0; b < mk.nr_batches; b++) {
+        slot = &mk.slots[b % mk.nr_slots];
+        pthread_mutex_lock(&mk.lock);
+        while (slot->batch != b || !slot->done)
+            pthread_cond_wait(&mk.cond, &mk.lock);
+        pthread_mutex_unlock(&mk.lock);
+
+        mk_write(fd, slot->out, slot->len, pos);
+        pos += slot->len;
+        memcpy(jump + b * MK_BATCH, slot->sizes,
+               min_t(size_t, MK_BATCH, mk.nr_blocks - b * MK_BATCH) *
+                   sizeof(uint32_t));
+
+        pthread_mutex_lock(&mk.lock);
+        slot->done = false;
+        slot->batch = b + mk.nr_slots;
+        pthread_cond_broadcast(&mk.cond);
+        pthread_mutex_unlock(&mk.lock);
+    }
+    for (i = 0; i < (size_t)threads; i++) pthread_join(tids[i], NULL);
+    free(tids);
+
+    mk_write(fd, jump, mk.nr_blocks * sizeof(uint32_t), pos);
+    mk_zfile_ht((struct zfile_ht *)space, false, pos);
+    pos += mk.nr_blocks * sizeof(uint32_t);
+    mk_write(fd, space, ZF_SPACE, pos);
+    pos += ZF_SPACE;
+
+    for (i = 0; i < mk.nr_slots; i++) free(mk.slots[i].out);
+    free(mk.slots);
+    free(jump);
+    return pos;
+}
+
+static uint64_t parse_size(const char *s) {
+    char *end;
+    uint64_t v = strtoull(s, &end, 0);
+
+    switch (*end) {
+        case 'k': case 'K': return v << 10;
+        case 'm': case 'M': return v << 20;
+        case 'g': case 'G': return v << 30;
+        case 't': case 'T': return v << 40;
+    }
+    return v;
+}
+
+static void mk_load_dict(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+
+    if (fd < 0 || fstat(fd, &st)) die("open %s: %s\n", path, strerror(errno));
+    if (st.st_size == 0 || st.st_size > ZF_DICT_MAX)
+        die("dictionary of %lld bytes, up to %d taken\n",
+            (long long)st.st_size, ZF_DICT_MAX);
+    mk.dict_size = st.st_size;
+    mk.dict = xmalloc(mk.dict_size);
+    if (pread(fd, mk.dict, mk.dict_size, 0) != (ssize_t)mk.dict_size)
+        die("read %s: %s\n", path, strerror(errno));
+    close(fd);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options] input.raw output.lsmtz\n"
+            "       %s [options] -s size output.lsmtz\n"
+            "  -b  block size, power of 2 from 4K to 1M, default 4K\n"
+            "  -c  codec, lz4 (default) or zstd\n"
+            "  -l  compression level of zstd, default 3\n"
+            "  -D  shared dictionary file of all blocks\n"
+            "  -V  append crc32c to blocks\n"
+            "  -j  compression threads, default online CPUs\n"
+            "  -s  synthesize `size` bytes of data instead of an input\n"
+            "  -F  split into about this many segments, laid out shuffled\n"
+            "  -Z  store zero filled ranges as data\n",
+            prog, prog);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    int threads = sysconf(_SC_NPROCESSORS_ONLN), opt, out;
+    uint64_t synth = 0, csize, t0, ns;
+    size_t fragment = 0, zeroed = 0, i;
+    const char *dict = NULL;
+    struct stat st;
+
+    mk.level = 3;
+    while ((opt = getopt(argc, argv, "b:c:l:D:Vj:s:F:Z")) != -1) {
+        switch (opt) {
+            case 'b':
+                mk.block_size = parse_size(optarg);
+                break;
+            case 'c':
+                if (!strcmp(optarg, "lz4"))
+                    mk.type = ZF_CODEC_LZ4;
+                else if (!strcmp(optarg, "zstd"))
+                    mk.type = ZF_CODEC_ZSTD;
+                else
+                    usage(argv[0]);
+                break;
+            case 'l':
+                mk.level = atoi(optarg);
+                break;
+            case 'D':
+                dict = optarg;
+                break;
+            case 'V':
+                mk.verify = true;
+                break;
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 's':
+                synth = parse_size(optarg);
+                break;
+            case 'F':
+                fragment = parse_size(optarg);
+                break;
+            case 'Z':
+                mk.keep_zero = true;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (optind != argc - (synth ? 1 : 2) || threads <= 0 ||
+        mk.block_size < 4096 || mk.block_size > (1 << 20) ||
+        (mk.block_size & (mk.block_size - 1)))
+        usage(argv[0]);
+    if (mk.type == ZF_CODEC_LZ4) mk.level = 0;
+    if (dict) mk_load_dict(dict);
+    if (dict && mk.type == ZF_CODEC_ZSTD) {
+        mk.cdict = ZSTD_createCDict(mk.dict, mk.dict_size, mk.level);
+        if (!mk.cdict) die("zstd: failed to load dictionary\n");
+    }
+
+    if (synth) {
+        mk.in_size = synth;
+    } else {
+        mk.fd = open(argv[optind], O_RDONLY);
+        if (mk.fd < 0 || fstat(mk.fd, &st))
+            die("open %s: %s\n", argv[optind], strerror(errno));
+        mk.in_size = st.st_size;
+        optind++;
+    }
+    mk.vsize = DIV_ROUND_UP(mk.in_size, SECTOR_SIZE);
+    if (!mk.vsize) die("empty input\n");
+
+    t0 = ktime_get_ns();
+    mk_build_segments();
+    mk_fragment(fragment);
+    mk_layout(fragment != 0);
+    for (i = 0; i < mk.nr_segs; i++) zeroed += mk.segs[i].zeroed;
+
+    out = open(argv[optind], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) die("open %s: %s\n", argv[optind], strerror(errno));
+    csize = mk_zfile(out, threads);
+    if (fsync(out) || close(out)) die("write output: %s\n", strerror(errno));
+    ns = ktime_get_ns() - t0;
+
+    printf("%s: %llu bytes, %zu segments (%zu zeroed), %zu blocks of %u, "
+           "%s%s\n",
+           argv[optind], (u64)mk.vsize * SECTOR_SIZE, mk.nr_segs, zeroed,
+           mk.nr_blocks, mk.block_size,
+           mk.type == ZF_CODEC_ZSTD ? "zstd" : "lz4",
+           mk.verify ? " with crc32c" : "");
+    printf("layer %llu bytes compressed to %llu, %.2f:1, %.1f MB/s with %d "
+           "threads\n",
+           (unsigned long long)mk.stream_size, (unsigned long long)csize,
+           (double)mk.stream_size / csize,
+           ns ? mk.stream_size * 1e3 / ns : 0.0, threads);
+    return 0;
+}
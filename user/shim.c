@@ -0,0 +1,153 @@
+#include <shim.h>
+
+int shim_verbose;
+
+#define SHIM_PARAMS_MAX 32
+
+static struct {
+    const char *name;
+    void *p;
+    size_t size;
+} shim_params[SHIM_PARAMS_MAX];
+static int shim_nr_params;
+
+void shim_param_register(const char *name, void *p, size_t size) {
+    if (shim_nr_params == SHIM_PARAMS_MAX) abort();
+    shim_params[shim_nr_params].name = name;
+    shim_params[shim_nr_params].p = p;
+    shim_params[shim_nr_params].size = size;
+    shim_nr_params++;
+}
+
+// integer and bool parameters only, none of zfile or lsmt takes a string
+int shim_param_set(const char *name, const char *value) {
+    unsigned long long v = strtoull(value, NULL, 0);
+    int i;
+
+    for (i = 0; i < shim_nr_params; i++) {
+        if (strcmp(shim_params[i].name, name)) continue;
+        switch (shim_params[i].size) {
+            case 1:
+                *(bool *)shim_params[i].p = v != 0;
+                return 0;
+            case 4:
+                *(u32 *)shim_params[i].p = v;
+                return 0;
+            case 8:
+                *(u64 *)shim_params[i].p = v;
+                return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+u32 crc32c(u32 crc, const void *p, size_t len) {
+    const u8 *b = p;
+    int k;
+
+    while (len--) {
+        crc ^= *b++;
+        for (k = 0; k < 8; k++) crc = crc >> 1 ^ (0x82f63b78 & -(crc & 1));
+    }
+    return crc;
+}
+
+struct file *filp_open(const char *path, int flags, unsigned short mode) {
+    struct file *f = calloc(1, sizeof(*f));
+    struct stat st;
+
+    if (!f) return ERR_PTR(-ENOMEM);
+    f->fd = open(path, flags, mode);
+    if (f->fd < 0 || fstat(f->fd, &st)) {
+        int err = -errno;
+
+        if (f->fd >= 0) close(f->fd);
+        free(f);
+        return ERR_PTR(err);
+    }
+    f->inode.i_size = st.st_size;
+    f->inode.i_ino = st.st_ino;
+    f->inode.i_mtime.tv_sec = st.st_mtime;
+    f->inode.sb.s_dev = st.st_dev;
+    f->inode.i_sb = &f->inode.sb;
+    f->f_inode = &f->inode;
+    f->f_path.name = path;
+    return f;
+}
+
+int filp_close(struct file *file, void *id) {
+    close(file->fd);
+    free(file);
+    return 0;
+}
+
+ssize_t kernel_read(struct file *file, void *buf, size_t count, loff_t *pos) {
+    ssize_t ret = pread(file->fd, buf, count, *pos);
+
+    if (ret < 0) return -errno;
+    *pos += ret;
+    return ret;
+}
+
+ssize_t kernel_write(struct file *file, const void *buf, size_t count,
+                     loff_t *pos) {
+    ssize_t ret = pwrite(file->fd, buf, count, *pos);
+    struct stat st;
+
+    if (ret < 0) return -errno;
+    *pos += ret;
+    if (!fstat(file->fd, &st)) file->inode.i_size = st.st_size;
+    return ret;
+}
+
+int vfs_fsync(struct file *file, int datasync) {
+    return fsync(file->fd) ? -errno : 0;
+}
+
+void iov_iter_kvec(struct iov_iter *i, unsigned int direction,
+                   const struct kvec *kvec, unsigned long nr_segs,
+                   size_t count) {
+    i->kvec = kvec;
+    i->bvec = NULL;
+    i->nr_segs = nr_segs;
+    i->iov_offset = 0;
+    i->count = count;
+}
+
+// move `i` on by `bytes`, copying `src` to the way if set, or zeros if `zero`
+static size_t iov_iter_step(struct iov_iter *i, size_t bytes, const void *src,
+                            bool zero) {
+    size_t done = 0, n;
+    void *dst;
+
+    bytes = min(bytes, i->count);
+    while (done < bytes) {
+        n = min(bytes - done, i->kvec->iov_len - i->iov_offset);
+        dst = i->kvec->iov_base + i->iov_offset;
+        if (src)
+            memcpy(dst, src + done, n);
+        else if (zero)
+            memset(dst, 0, n);
+        done += n;
+        i->iov_offset += n;
+        i->count -= n;
+        if (i->iov_offset == i->kvec->iov_len && i->nr_segs > 1) {
+            i->kvec++;
+            i->nr_segs--;
+            i->iov_offset = 0;
+        }
+    }
+    return done;
+}
+
+size_t copy_to_iter(const void *addr, size_t bytes, struct iov_iter *i) {
+    return iov_iter_step(i, bytes, addr, false);
+}
+
+size_t iov_iter_zero(size_t bytes, struct iov_iter *i) {
+    return iov_iter_step(i, bytes, NULL, true);
+}
+
+void iov_iter_advance(struct iov_iter *i, size_t bytes) {
+    iov_iter_step(i, bytes, NULL, false);
+}
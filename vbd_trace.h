@@ -0,0 +1,136 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM vbd
+
+#if !defined(__VBD_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __VBD_TRACE_H__
+
+#include <linux/blk-mq.h>
+#include <linux/tracepoint.h>
+
+// a request of device `vbd<dev>`, identified by its tag
+DECLARE_EVENT_CLASS(vbd_rq,
+    TP_PROTO(int dev, struct request *rq),
+    TP_ARGS(dev, rq),
+    TP_STRUCT__entry(
+        __field(int, dev)
+        __field(int, tag)
+        __field(sector_t, sector)
+        __field(unsigned int, bytes)
+    ),
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->tag = rq->tag;
+        __entry->sector = blk_rq_pos(rq);
+        __entry->bytes = blk_rq_bytes(rq);
+    ),
+    TP_printk("vbd%d tag %d sector %llu bytes %u", __entry->dev,
+              __entry->tag, (unsigned long long)__entry->sector,
+              __entry->bytes)
+);
+
+// entering `ovbd_queue_rq`
+DEFINE_EVENT(vbd_rq, vbd_queue_rq,
+    TP_PROTO(int dev, struct request *rq),
+    TP_ARGS(dev, rq)
+);
+
+// picked up by the queue worker
+DEFINE_EVENT(vbd_rq, vbd_rq_start,
+    TP_PROTO(int dev, struct request *rq),
+    TP_ARGS(dev, rq)
+);
+
+TRACE_EVENT(vbd_complete_rq,
+    TP_PROTO(int dev, struct request *rq, int err),
+    TP_ARGS(dev, rq, err),
+    TP_STRUCT__entry(
+        __field(int, dev)
+        __field(int, tag)
+        __field(sector_t, sector)
+        __field(unsigned int, bytes)
+        __field(int, err)
+    ),
+    TP_fast_assign(
+        __entry->dev = dev;
+        __entry->tag = rq->tag;
+        __entry->sector = blk_rq_pos(rq);
+        __entry->bytes = blk_rq_bytes(rq);
+        __entry->err = err;
+    ),
+    TP_printk("vbd%d tag %d sector %llu bytes %u err %d", __entry->dev,
+              __entry->tag, (unsigned long long)__entry->sector,
+              __entry->bytes, __entry->err)
+);
+
+// index walk from sector `offset`, first segment found at `seg_offset`,
+// `length` 0 if none. `err` if index pages could not be had
+TRACE_EVENT(vbd_index_lookup,
+    TP_PROTO(u64 offset, u64 seg_offset, u32 length, u64 moffset, int err),
+    TP_ARGS(offset, seg_offset, length, moffset, err),
+    TP_STRUCT__entry(
+        __field(u64, offset)
+        __field(u64, seg_offset)
+        __field(u32, length)
+        __field(u64, moffset)
+        __field(int, err)
+    ),
+    TP_fast_assign(
+        __entry->offset = offset;
+        __entry->seg_offset = seg_offset;
+        __entry->length = length;
+        __entry->moffset = moffset;
+        __entry->err = err;
+    ),
+    TP_printk("offset %llu segment %llu length %u moffset %llu err %d",
+              __entry->offset, __entry->seg_offset, __entry->length,
+              __entry->moffset, __entry->err)
+);
+
+// compressed data [begin, begin + range) of back file read in `ns`
+TRACE_EVENT(vbd_fetch,
+    TP_PROTO(loff_t begin, loff_t range, bool aio, u64 ns),
+    TP_ARGS(begin, range, aio, ns),
+    TP_STRUCT__entry(
+        __field(loff_t, begin)
+        __field(loff_t, range)
+        __field(bool, aio)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->begin = begin;
+        __entry->range = range;
+        __entry->aio = aio;
+        __entry->ns = ns;
+    ),
+    TP_printk("begin %lld range %lld%s ns %llu", __entry->begin,
+              __entry->range, __entry->aio ? " aio" : "", __entry->ns)
+);
+
+// block `idx` of `csize` bytes decompressed to `len`, or error, in `ns`
+TRACE_EVENT(vbd_decompress,
+    TP_PROTO(size_t idx, size_t csize, int len, u64 ns),
+    TP_ARGS(idx, csize, len, ns),
+    TP_STRUCT__entry(
+        __field(size_t, idx)
+        __field(size_t, csize)
+        __field(int, len)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->idx = idx;
+        __entry->csize = csize;
+        __entry->len = len;
+        __entry->ns = ns;
+    ),
+    TP_printk("block %zu csize %zu len %d ns %llu", __entry->idx,
+              __entry->csize, __entry->len, __entry->ns)
+);
+
+#endif
+
+// this header lives out of include/trace
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE vbd_trace
+#include <trace/define_trace.h>
@@ -1,21 +1,71 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/crc32c.h>
 #include <linux/errno.h>
+#include <linux/ktime.h>
 #include <linux/lz4.h>
 #include <linux/mm.h>
 #include <linux/mman.h>
 #include <linux/slab.h>
 #include <linux/uio.h>
 #include <linux/vmalloc.h>
+#include <linux/wait.h>
 #include <linux/pagemap.h>
 #include <linux/file.h>
+#include <linux/hash.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/sched/mm.h>
+#include <linux/workqueue.h>
+#include <asm/unaligned.h>
+#include <linux/zstd.h>
 
+#include "lcache.h"
+#include "vbd_trace.h"
 #include "zfile.h"
 
 static const uint32_t ZF_SPACE = 512;
+// decompressed bytes covered by one back file read at most
+static const size_t ZF_WINDOW_SIZE = 512 * 1024;
+static const unsigned int ZF_POOL_MIN = 2;
+static const size_t ZF_DICT_MAX = 16 * 1024 * 1024;
+// jobs a window is split into by parallel decompression at most
+#define ZF_PARALLEL_MAX 16
 static uint64_t *MAGIC0 = (uint64_t *)"ZFile\0\1";
 static const uuid_t MAGIC1 = UUID_INIT(0x74756a69, 0x2e79, 0x7966, 0x40, 0x41,
                                        0x6c, 0x69, 0x62, 0x61, 0x62, 0x61);
+
+static unsigned int cache_mb = 64;
+module_param(cache_mb, uint, 0444);
+MODULE_PARM_DESC(cache_mb,
+                 "Decompressed block cache per zfile in MiB, 0 to disable");
+
+static unsigned int parallel_blocks = 16;
+module_param(parallel_blocks, uint, 0644);
+MODULE_PARM_DESC(parallel_blocks,
+                 "Decompress a fetched window on several CPUs if it spans "
+                 "at least this many blocks, 0 to disable");
+
+static bool map_pages = true;
+module_param(map_pages, bool, 0644);
+MODULE_PARM_DESC(map_pages,
+                 "Decompress from page cache of back file in place, instead "
+                 "of reading compressed data into a buffer first");
+
+static bool lazy_jump;
+module_param(lazy_jump, bool, 0444);
+MODULE_PARM_DESC(lazy_jump,
+                 "Build jump table of a zfile when its blocks are first read, "
+                 "instead of at open");
+
+static struct workqueue_struct *zfile_wq;
+
+// zfiles opened by path, shared by all opening the same layer
+static LIST_HEAD(zfile_layers);
+static DEFINE_MUTEX(zfile_layers_lock);
+
 static struct file *file_open(const char *path, int flags, int rights) {
     struct file *fp = NULL;
     fp = filp_open(path, O_RDONLY, 0);
@@ -59,21 +109,193 @@ static ssize_t file_read(struct file *file, void *buf, size_t count,
     return sret;
 }
 
-static ssize_t file_pread(struct file *file, void *buf , size_t count,
-                         loff_t pos) {
-    ssize_t ret, sret = 0;
-    loff_t lpos;
-    size_t flen = file_len(file);
-    if (pos > flen) return 0;
-    if (pos + count > flen) count = flen - pos;
+// lz4 keeps no context, but the dictionary of a zfile using one
+struct zfile_lz4_ctx {
+    const void *dict;
+    size_t dict_size;
+};
 
-    struct address_space *mapping = file->f_mapping;
-    if (!mapping)
-	return 0;
+static int zfile_lz4_init(void **ctx, const void *dict, size_t dict_size) {
+    struct zfile_lz4_ctx *c;
 
-    struct page *to_load = read_cache_page( mapping, 
-		    pos / 4096, NULL, buf ); 
-    return sret;
+    if (!dict) return 0;
+    c = kmalloc(sizeof(*c), GFP_KERNEL);
+    if (!c) return -ENOMEM;
+    c->dict = dict;
+    c->dict_size = dict_size;
+    *ctx = c;
+    return 0;
+}
+
+static void zfile_lz4_exit(void *ctx) { kfree(ctx); }
+
+static int zfile_lz4_decompress(void *ctx, const unsigned char *src,
+                                size_t len, unsigned char *dst, size_t cap) {
+    struct zfile_lz4_ctx *c = ctx;
+
+    if (c)
+        return LZ4_decompress_safe_usingDict(src, dst, len, cap, c->dict,
+                                             c->dict_size);
+    return LZ4_decompress_safe(src, dst, len, cap);
+}
+
+// zstd needs a decompression context per concurrent call. contexts are
+// pooled, taken and put back around each block, so decompression may sleep
+// and be preempted. a dictionary is digested once into `ddict`
+struct zfile_zstd_dctx {
+    struct list_head list;
+    void *ws;
+    ZSTD_DCtx *dctx;
+};
+
+struct zfile_zstd_ctx {
+    spinlock_t lock;
+    struct list_head free;
+    wait_queue_head_t wait;
+    unsigned int nr;
+    unsigned int max;  // contexts kept, more are freed once put back
+    void *ddict_ws;
+    ZSTD_DDict *ddict;
+};
+
+static void zfile_zstd_dctx_free(struct zfile_zstd_dctx *d) {
+    if (!d) return;
+    vfree(d->ws);
+    kfree(d);
+}
+
+// reached from any reader, not all of them in NOIO scope, so enter it here.
+// vmalloc takes no gfp flags to pass GFP_NOIO by
+static struct zfile_zstd_dctx *zfile_zstd_dctx_alloc(void) {
+    size_t size = ZSTD_DCtxWorkspaceBound();
+    struct zfile_zstd_dctx *d;
+    unsigned int noio = memalloc_noio_save();
+
+    d = kzalloc(sizeof(*d), GFP_KERNEL);
+    if (!d) goto out;
+    d->ws = vmalloc(size);
+    if (d->ws) d->dctx = ZSTD_initDCtx(d->ws, size);
+    if (!d->dctx) {
+        zfile_zstd_dctx_free(d);
+        d = NULL;
+    }
+out:
+    memalloc_noio_restore(noio);
+    return d;
+}
+
+// take a free context, or allocate one. only if that fails, wait for one to
+// be put back, there is always one at least
+static struct zfile_zstd_dctx *zfile_zstd_take(struct zfile_zstd_ctx *c) {
+    struct zfile_zstd_dctx *d;
+
+    for (;;) {
+        spin_lock(&c->lock);
+        d = list_first_entry_or_null(&c->free, struct zfile_zstd_dctx, list);
+        if (d) {
+            list_del(&d->list);
+            spin_unlock(&c->lock);
+            return d;
+        }
+        c->nr++;
+        spin_unlock(&c->lock);
+
+        d = zfile_zstd_dctx_alloc();
+        if (d) return d;
+        spin_lock(&c->lock);
+        c->nr--;
+        spin_unlock(&c->lock);
+        wait_event(c->wait, !list_empty_careful(&c->free));
+    }
+}
+
+static void zfile_zstd_put(struct zfile_zstd_ctx *c,
+                           struct zfile_zstd_dctx *d) {
+    spin_lock(&c->lock);
+    if (c->nr > c->max) {
+        c->nr--;
+        spin_unlock(&c->lock);
+        zfile_zstd_dctx_free(d);
+        return;
+    }
+    list_add(&d->list, &c->free);
+    spin_unlock(&c->lock);
+    wake_up(&c->wait);
+}
+
+static void zfile_zstd_exit(void *ctx) {
+    struct zfile_zstd_ctx *c = ctx;
+    struct zfile_zstd_dctx *d, *next;
+
+    if (!c) return;
+    list_for_each_entry_safe(d, next, &c->free, list) {
+        list_del(&d->list);
+        zfile_zstd_dctx_free(d);
+    }
+    vfree(c->ddict_ws);
+    kfree(c);
+}
+
+static int zfile_zstd_init(void **ctx, const void *dict, size_t dict_size) {
+    struct zfile_zstd_ctx *c;
+    struct zfile_zstd_dctx *d;
+
+    c = kzalloc(sizeof(*c), GFP_KERNEL);
+    if (!c) return -ENOMEM;
+    spin_lock_init(&c->lock);
+    INIT_LIST_HEAD(&c->free);
+    init_waitqueue_head(&c->wait);
+    c->max = num_possible_cpus();
+    d = zfile_zstd_dctx_alloc();
+    if (!d) goto fail;
+    list_add(&d->list, &c->free);
+    c->nr = 1;
+    if (dict) {
+        c->ddict_ws = vmalloc(ZSTD_DDictWorkspaceBound());
+        if (!c->ddict_ws) goto fail;
+        c->ddict = ZSTD_initDDict(dict, dict_size, c->ddict_ws,
+                                  ZSTD_DDictWorkspaceBound());
+        if (!c->ddict) goto fail;
+    }
+    *ctx = c;
+    return 0;
+
+fail:
+    zfile_zstd_exit(c);
+    return -ENOMEM;
+}
+
+static int zfile_zstd_decompress(void *ctx, const unsigned char *src,
+                                 size_t len, unsigned char *dst, size_t cap) {
+    struct zfile_zstd_ctx *c = ctx;
+    struct zfile_zstd_dctx *d = zfile_zstd_take(c);
+    size_t ret;
+
+    if (c->ddict)
+        ret = ZSTD_decompress_usingDDict(d->dctx, dst, cap, src, len,
+                                         c->ddict);
+    else
+        ret = ZSTD_decompressDCtx(d->dctx, dst, cap, src, len);
+    zfile_zstd_put(c, d);
+    return ZSTD_isError(ret) ? -EIO : ret;
+}
+
+// indexed by `compress_options.type`
+static const struct zfile_codec zfile_codecs[] = {
+    [ZF_CODEC_LZ4] = {.name = "lz4",
+                      .init = zfile_lz4_init,
+                      .exit = zfile_lz4_exit,
+                      .decompress = zfile_lz4_decompress},
+    [ZF_CODEC_ZSTD] = {.name = "zstd",
+                       .init = zfile_zstd_init,
+                       .exit = zfile_zstd_exit,
+                       .decompress = zfile_zstd_decompress},
+};
+
+static const struct zfile_codec *zfile_codec_find(uint8_t type) {
+    if (type >= ARRAY_SIZE(zfile_codecs) || !zfile_codecs[type].decompress)
+        return NULL;
+    return &zfile_codecs[type];
 }
 
 size_t zfile_len(struct zfile *zfile) { return zfile->header.vsize; }
@@ -82,104 +304,1020 @@ struct path zfile_getpath(struct zfile *zfile) {
     return zfile->fp->f_path;
 }
 
-ssize_t zfile_read(struct zfile *zf, void *dst, size_t count, loff_t offset) {
-    size_t start_idx, end_idx;
-    loff_t begin, range;
-    size_t bs;
+static int zfile_cache_init(struct zfile_cache *cache, size_t entry_size,
+                            size_t max_entries) {
+    size_t i;
+
+    spin_lock_init(&cache->lock);
+    INIT_LIST_HEAD(&cache->lru);
+    cache->clock = 0;
+    cache->nr_entries = 0;
+    cache->max_entries = max_entries;
+    cache->entry_size = entry_size;
+    cache->buckets = NULL;
+    if (max_entries == 0) return 0;
+
+    cache->hash_bits = ilog2(roundup_pow_of_two(max_entries));
+    cache->buckets = kvmalloc_array(1UL << cache->hash_bits,
+                                    sizeof(struct hlist_head), GFP_KERNEL);
+    if (!cache->buckets) return -ENOMEM;
+    for (i = 0; i < (1UL << cache->hash_bits); i++)
+        INIT_HLIST_HEAD(&cache->buckets[i]);
+    return 0;
+}
+
+static void zfile_cache_destroy(struct zfile_cache *cache) {
+    struct zfile_cache_entry *ent, *next;
+
+    if (!cache->buckets) return;
+    list_for_each_entry_safe(ent, next, &cache->lru, lru) {
+        list_del(&ent->lru);
+        kfree(ent);
+    }
+    cache->nr_entries = 0;
+    kvfree(cache->buckets);
+    cache->buckets = NULL;
+}
+
+static struct zfile_cache_entry *zfile_cache_find(struct zfile_cache *cache,
+                                                  size_t idx) {
+    struct zfile_cache_entry *ent;
+
+    hlist_for_each_entry(ent, &cache->buckets[hash_long(idx, cache->hash_bits)],
+                         node) {
+        if (ent->idx == idx) return ent;
+    }
+    return NULL;
+}
+
+static void zfile_cache_put(struct zfile_cache_entry *ent) {
+    if (atomic_dec_and_test(&ent->ref)) kfree(ent);
+}
+
+// copy `count` bytes at `poff` of block `idx` out of cache.
+// returns bytes copied, or -ENOENT on cache miss
+static ssize_t zfile_cache_read(struct zfile_cache *cache, size_t idx,
+                                struct iov_iter *to, loff_t poff,
+                                size_t count) {
+    struct zfile_cache_entry *ent;
     ssize_t ret;
-    int dc;
-    ssize_t i;
-    unsigned char *src_buf;
-    unsigned char *decomp_buf;
-    loff_t decomp_offset;
-    unsigned char *c_buf;
-    loff_t poff;
-    size_t pcnt;
 
-    if (!zf) {
-        pr_info("zfile: failed empty zf\n");
-        return -EIO;
+    if (!cache->buckets) return -ENOENT;
+    spin_lock(&cache->lock);
+    ent = zfile_cache_find(cache, idx);
+    if (ent) {
+        atomic_inc(&ent->ref);
+        // among the most recent quarter already, leave it there
+        if (cache->clock - ent->touched >= cache->max_entries / 4) {
+            list_move(&ent->lru, &cache->lru);
+            ent->touched = ++cache->clock;
+        }
     }
-    bs = zf->header.opt.block_size;
-    // read empty
-    if (count == 0) return 0;
+    spin_unlock(&cache->lock);
+    if (!ent) return -ENOENT;
+
+    // pinned, an eviction meanwhile leaves it to be freed by the last reader
+    ret = clamp_t(ssize_t, ent->len - poff, 0, count);
+    if (ret > 0 && copy_to_iter(ent->data + poff, ret, to) != ret)
+        ret = -EFAULT;
+    zfile_cache_put(ent);
+    return ret;
+}
+
+static bool zfile_cache_contains(struct zfile_cache *cache, size_t idx) {
+    bool ret;
+
+    if (!cache->buckets) return false;
+    spin_lock(&cache->lock);
+    ret = zfile_cache_find(cache, idx) != NULL;
+    spin_unlock(&cache->lock);
+    return ret;
+}
+
+// get an unpublished entry to decompress into, recycling the least recently
+// used one once the cache is full. returns NULL if cache is disabled or
+// no memory, caller should fall back to a private buffer then
+static struct zfile_cache_entry *zfile_cache_get(struct zfile_cache *cache) {
+    struct zfile_cache_entry *ent = NULL;
+
+    if (!cache->buckets) return NULL;
+    spin_lock(&cache->lock);
+    if (cache->nr_entries >= cache->max_entries) {
+        ent = list_last_entry(&cache->lru, struct zfile_cache_entry, lru);
+        list_del(&ent->lru);
+        hlist_del(&ent->node);
+        cache->nr_entries--;
+    }
+    spin_unlock(&cache->lock);
+    // still being copied out of, its last reader frees it
+    if (ent && !atomic_dec_and_test(&ent->ref)) ent = NULL;
+    if (!ent)
+        ent = kmalloc(sizeof(*ent) + cache->entry_size, GFP_NOIO);
+    return ent;
+}
+
+static void zfile_cache_insert(struct zfile_cache *cache,
+                               struct zfile_cache_entry *ent, size_t idx,
+                               int len) {
+    ent->idx = idx;
+    ent->len = len;
+    atomic_set(&ent->ref, 1);
+    spin_lock(&cache->lock);
+    // another reader may have filled the same block meanwhile
+    if (zfile_cache_find(cache, idx) ||
+        cache->nr_entries >= cache->max_entries) {
+        spin_unlock(&cache->lock);
+        kfree(ent);
+        return;
+    }
+    hlist_add_head(&ent->node,
+                   &cache->buckets[hash_long(idx, cache->hash_bits)]);
+    list_add(&ent->lru, &cache->lru);
+    ent->touched = ++cache->clock;
+    cache->nr_entries++;
+    spin_unlock(&cache->lock);
+}
+
+struct zfile_job {
+    struct work_struct work;
+    struct zfile *zf;
+    const unsigned char *src;
+    loff_t begin;
+    size_t from, to;
+    atomic_t *pending;
+    struct completion *done;
+};
+
+static void zfile_scratch_free(struct zfile_scratch *scr) {
+    if (!scr) return;
+    vfree(scr->cbuf);
+    vfree(scr->bounce);
+    kfree(scr->dbuf);
+    kfree(scr->pages);
+    kfree(scr->jobs);
+    kfree(scr);
+}
+
+// taken beyond the pool by readers not all in NOIO scope, so enter it here
+static struct zfile_scratch *zfile_scratch_alloc(struct zfile *zf) {
+    struct zfile_scratch *scr;
+    unsigned int noio = memalloc_noio_save();
+
+    scr = kzalloc(sizeof(*scr), GFP_KERNEL);
+    if (!scr) goto out;
+    scr->cbuf = vmalloc(zf->pool.cbuf_size);
+    scr->dbuf = kmalloc(zf->header.opt.block_size, GFP_KERNEL);
+    // a window may start in the middle of a page
+    scr->max_pages = (zf->pool.cbuf_size >> PAGE_SHIFT) + 1;
+    scr->pages =
+        kmalloc_array(scr->max_pages, sizeof(struct page *), GFP_KERNEL);
+    scr->jobs =
+        kmalloc_array(ZF_PARALLEL_MAX, sizeof(struct zfile_job), GFP_KERNEL);
+    if (!scr->cbuf || !scr->dbuf || !scr->pages || !scr->jobs) {
+        zfile_scratch_free(scr);
+        scr = NULL;
+    }
+out:
+    memalloc_noio_restore(noio);
+    return scr;
+}
+
+static int zfile_pool_init(struct zfile *zf) {
+    struct zfile_pool *pool = &zf->pool;
+    struct zfile_scratch *scr;
+
+    spin_lock_init(&pool->lock);
+    INIT_LIST_HEAD(&pool->free);
+    pool->nr = 0;
+    pool->max = max_t(unsigned int, num_possible_cpus(), ZF_POOL_MIN);
+    pool->window =
+        max_t(size_t, ZF_WINDOW_SIZE / zf->header.opt.block_size, 1);
+    pool->cbuf_size = PAGE_ALIGN(pool->window * zf->max_csize);
+
+    while (pool->nr < ZF_POOL_MIN) {
+        scr = zfile_scratch_alloc(zf);
+        if (!scr) return -ENOMEM;
+        list_add(&scr->list, &pool->free);
+        pool->nr++;
+    }
+    return 0;
+}
+
+static void zfile_pool_destroy(struct zfile_pool *pool) {
+    struct zfile_scratch *scr, *next;
+
+    if (!pool->free.next) return;
+    list_for_each_entry_safe(scr, next, &pool->free, list) {
+        list_del(&scr->list);
+        zfile_scratch_free(scr);
+    }
+    pool->nr = 0;
+}
+
+static struct zfile_scratch *zfile_scratch_take(struct zfile *zf,
+                                                bool beyond) {
+    struct zfile_pool *pool = &zf->pool;
+    struct zfile_scratch *scr;
+
+    spin_lock(&pool->lock);
+    scr = list_first_entry_or_null(&pool->free, struct zfile_scratch, list);
+    if (scr) {
+        list_del(&scr->list);
+        spin_unlock(&pool->lock);
+        return scr;
+    }
+    if (!beyond && pool->nr >= pool->max) {
+        spin_unlock(&pool->lock);
+        return NULL;
+    }
+    pool->nr++;
+    spin_unlock(&pool->lock);
+
+    scr = zfile_scratch_alloc(zf);
+    if (!scr) {
+        spin_lock(&pool->lock);
+        pool->nr--;
+        spin_unlock(&pool->lock);
+    }
+    return scr;
+}
+
+// take a free scratch, or allocate one. never waits for others to be put
+// back, as async readers may hold them until their completion runs
+struct zfile_scratch *zfile_scratch_get(struct zfile *zf) {
+    return zfile_scratch_take(zf, true);
+}
+
+struct zfile_scratch *zfile_scratch_tryget(struct zfile *zf) {
+    return zfile_scratch_take(zf, false);
+}
+
+void zfile_scratch_put(struct zfile *zf, struct zfile_scratch *scr) {
+    struct zfile_pool *pool = &zf->pool;
+
+    if (!scr) return;
+    spin_lock(&pool->lock);
+    if (pool->nr > pool->max) {
+        pool->nr--;
+        spin_unlock(&pool->lock);
+        zfile_scratch_free(scr);
+        return;
+    }
+    list_add(&scr->list, &pool->free);
+    spin_unlock(&pool->lock);
+}
+
+size_t zfile_scratch_size(struct zfile *zf) { return zf->pool.cbuf_size; }
+
+static void zfile_unmap(struct zfile_scratch *scr) {
+    unsigned int i;
+
+    if (!scr || !scr->nr_pages) return;
+    vm_unmap_ram(scr->vaddr, scr->nr_pages);
+    for (i = 0; i < scr->nr_pages; i++) put_page(scr->pages[i]);
+    scr->vaddr = NULL;
+    scr->nr_pages = 0;
+}
+
+// map page cache pages of back file holding [begin, begin + range) into one
+// virtual range, so blocks straddling pages decompress in place as well.
+// returns NULL if the back file has no page cache to read through
+static const unsigned char *zfile_map(struct zfile *zf,
+                                      struct zfile_scratch *scr, loff_t begin,
+                                      loff_t range) {
+    struct address_space *mapping = zf->fp->f_mapping;
+    pgoff_t first = begin >> PAGE_SHIFT;
+    unsigned int nr = ((begin + range - 1) >> PAGE_SHIFT) - first + 1;
+    struct page *page;
+
+    if (!mapping || !mapping->a_ops->readpage || nr > scr->max_pages)
+        return NULL;
+    while (scr->nr_pages < nr) {
+        page = read_cache_page(mapping, first + scr->nr_pages, NULL, zf->fp);
+        if (IS_ERR(page)) goto fail;
+        scr->pages[scr->nr_pages++] = page;
+    }
+    scr->vaddr = vm_map_ram(scr->pages, nr, NUMA_NO_NODE);
+    if (!scr->vaddr) goto fail;
+    return scr->vaddr + offset_in_page(begin);
+
+fail:
+    while (scr->nr_pages) put_page(scr->pages[--scr->nr_pages]);
+    return NULL;
+}
+
+// get compressed data of [begin, begin + range) from back file, in place in
+// its page cache if possible, or read into `scr->cbuf`, through the local
+// cache if any. mapping of an earlier fetch by `scr` is released first
+static const unsigned char *zfile_fetch(struct zfile *zf,
+                                        struct zfile_scratch *scr,
+                                        loff_t begin, loff_t range) {
+    const unsigned char *src = scr->cbuf;
+    u64 start = ktime_get_ns();
+    unsigned int noio;
+    ssize_t cnt;
+
+    zfile_unmap(scr);
+    if (zf->lcache) {
+        if (!scr->bounce) {
+            noio = memalloc_noio_save();
+            scr->bounce = vmalloc(zf->pool.cbuf_size);
+            memalloc_noio_restore(noio);
+        }
+        // without a bounce buffer, partial chunks are read but not kept
+        cnt = lcache_read(zf->lcache, scr->cbuf, range, begin, scr->bounce,
+                          scr->bounce ? zf->pool.cbuf_size : 0);
+        goto out;
+    }
+    if (map_pages) {
+        src = zfile_map(zf, scr, begin, range);
+        if (src) {
+            cnt = range;
+            goto out;
+        }
+        src = scr->cbuf;
+    }
+    cnt = file_read(zf->fp, scr->cbuf, range, begin);
+out:
+    if (cnt != range) {
+        pr_info("zfile: Read file failed, %ld != %lld\n", cnt, range);
+        return NULL;
+    }
+    trace_vbd_fetch(begin, range, false, ktime_get_ns() - start);
+    vbd_stat_add(&zf->stats, VBD_FETCHED, range);
+    vbd_stat_time(&zf->stats, VBD_LAT_BACKING, start);
+    return src;
+}
+
+static int zfile_jump_ensure(struct zfile *zf, size_t first, size_t last);
+
+// back file offset of block `idx`, `idx` up to the number of blocks. its
+// page of the jump table must have been built by `zfile_jump_ensure`
+static loff_t zfile_block_offset(const struct zfile *zf, size_t idx) {
+    const struct jump_table *jt = &zf->jump;
+    const uint64_t *flat = jt->flat[idx / ZF_JUMP_PAGE];
+    uint64_t part;
+
+    if (flat) return flat[idx % ZF_JUMP_PAGE];
+    part = jt->partial_offset[idx / ZF_JUMP_GROUP];
+    return (part >> 16) + (idx % ZF_JUMP_GROUP) * (part & U16_MAX) +
+           jt->deltas[idx];
+}
+
+// compressed size of block `idx`, checksum included
+static size_t zfile_block_csize(const struct zfile *zf, size_t idx) {
+    return zfile_block_offset(zf, idx + 1) - zfile_block_offset(zf, idx);
+}
+
+// clamp [offset, offset + count) to the file, returns the new count
+static size_t zfile_clamp(struct zfile *zf, size_t count, loff_t offset) {
     // read from over-tail
     if (offset > zf->header.vsize) {
-        pr_info("zfile: read over tail %lld > %lld\n", offset, zf->header.vsize);
+        pr_debug("zfile: read over tail %lld > %lld\n", offset, zf->header.vsize);
         return 0;
     }
     // read till tail
     if (offset + count > zf->header.vsize) {
         count = zf->header.vsize - offset;
     }
+    return count;
+}
+
+int zfile_range(struct zfile *zf, size_t count, loff_t offset, loff_t *begin,
+                loff_t *range) {
+    size_t bs = zf->header.opt.block_size;
+    size_t start_idx, end_idx;
+
+    count = zfile_clamp(zf, count, offset);
+    if (count == 0) return -EINVAL;
     start_idx = offset / bs;
     end_idx = (offset + count - 1) / bs;
+    if (zfile_jump_ensure(zf, start_idx, end_idx + 1)) return -EIO;
+    *begin = zfile_block_offset(zf, start_idx);
+    *range = zfile_block_offset(zf, end_idx + 1) - *begin;
+    return 0;
+}
 
-    begin = zf->jump[start_idx].partial_offset;
-    range = zf->jump[end_idx].partial_offset + zf->jump[end_idx].delta - begin;
+bool zfile_cached(struct zfile *zf, size_t count, loff_t offset) {
+    size_t bs = zf->header.opt.block_size;
+    size_t i;
 
-    //src_buf = kmalloc(range, GFP_NOIO);
-    decomp_buf = kmalloc(zf->header.opt.block_size, GFP_NOIO);
+    count = zfile_clamp(zf, count, offset);
+    if (count == 0) return true;
+    for (i = offset / bs; i <= (offset + count - 1) / bs; i++) {
+        if (!zfile_cache_contains(&zf->cache, i)) return false;
+    }
+    return true;
+}
 
-    // read compressed data
-    ret = file_pread(zf->fp, src_buf, range, begin);
-    if (ret != range) {
-        pr_info("zfile: Read file failed, %ld != %lld\n", ret, range);
-        ret = -EIO;
-        goto fail_read;
+ssize_t zfile_read_cached(struct zfile *zf, struct iov_iter *to, size_t count,
+                          loff_t offset, size_t *hits) {
+    size_t bs = zf->header.opt.block_size;
+    size_t idx, pcnt;
+    ssize_t ret = 0, cnt;
+    loff_t poff;
+
+    count = zfile_clamp(zf, count, offset);
+    while (count) {
+        idx = offset / bs;
+        poff = offset - idx * bs;
+        pcnt = min_t(size_t, count, bs - poff);
+        cnt = zfile_cache_read(&zf->cache, idx, to, poff, pcnt);
+        if (cnt < 0) return cnt == -ENOENT ? -EAGAIN : cnt;
+        (*hits)++;
+        ret += cnt;
+        // short block at the end of file
+        if (cnt < pcnt) break;
+        offset += cnt;
+        count -= cnt;
+    }
+    return ret;
+}
+
+// check the crc32c trailing compressed block `idx` at `src`, unless it is
+// off or, in first-touch mode, the block passed once already
+static int zfile_verify_block(struct zfile *zf, const unsigned char *src,
+                              size_t idx) {
+    size_t len = zfile_block_csize(zf, idx) - sizeof(uint32_t);
+    int mode = READ_ONCE(zf->verify_mode);
+    uint32_t crc;
+
+    if (mode == ZF_VERIFY_OFF) return 0;
+    if (mode == ZF_VERIFY_FIRST && test_bit(idx, zf->verified)) return 0;
+    // libcrc32c goes through crypto API, which picks crc32c-intel and alike
+    crc = ~crc32c(~0U, src, len);
+    if (crc != get_unaligned_le32(src + len)) {
+        pr_info("zfile: checksum of block %zu mismatch, %08x != %08x\n", idx,
+                crc, get_unaligned_le32(src + len));
+        return -EIO;
+    }
+    // tracked in every mode, so the bitmap stays valid across mode changes
+    if (!test_bit(idx, zf->verified)) set_bit(idx, zf->verified);
+    return 0;
+}
+
+// decompress block `idx` from `src`, which holds compressed data read from
+// back file at `begin`, returns decompressed length or error
+static int zfile_decompress_block(struct zfile *zf, const unsigned char *src,
+                                  loff_t begin, size_t idx,
+                                  unsigned char *out) {
+    u64 start = ktime_get_ns();
+    int dc;
+
+    src += zfile_block_offset(zf, idx) - begin;
+    if (zf->header.opt.verify && zfile_verify_block(zf, src, idx))
+        return -EIO;
+    dc = zf->codec->decompress(
+        zf->codec_ctx, src,
+        zfile_block_csize(zf, idx) -
+            (zf->header.opt.verify ? sizeof(uint32_t) : 0),
+        out, zf->header.opt.block_size);
+    trace_vbd_decompress(idx, zfile_block_csize(zf, idx), dc,
+                         ktime_get_ns() - start);
+    if (dc <= 0) {
+        pr_info("zfile: decompress block %zu failed\n", idx);
+        return -EIO;
+    }
+    vbd_stat_add(&zf->stats, VBD_DECOMPRESSED, 1);
+    vbd_stat_time(&zf->stats, VBD_LAT_DECOMPRESS, start);
+    return dc;
+}
+
+// modes from the strictest on
+static const int zfile_verify_order[] = {ZF_VERIFY_ALWAYS, ZF_VERIFY_FIRST,
+                                         ZF_VERIFY_OFF};
+
+static void zfile_update_verify(struct zfile *zf, int mode, int delta) {
+    int i;
+
+    if (mode < 0 || mode >= ZF_VERIFY_MODES) mode = ZF_VERIFY_ALWAYS;
+    mutex_lock(&zfile_layers_lock);
+    zf->verify_users[mode] += delta;
+    for (i = 0; i < ARRAY_SIZE(zfile_verify_order); i++) {
+        if (zf->verify_users[zfile_verify_order[i]]) break;
+    }
+    WRITE_ONCE(zf->verify_mode, i < ARRAY_SIZE(zfile_verify_order)
+                                    ? zfile_verify_order[i]
+                                    : ZF_VERIFY_ALWAYS);
+    mutex_unlock(&zfile_layers_lock);
+}
+
+void zfile_get_verify(struct zfile *zf, int mode) {
+    zfile_update_verify(zf, mode, 1);
+}
+
+void zfile_put_verify(struct zfile *zf, int mode) {
+    zfile_update_verify(zf, mode, -1);
+}
+
+// kernel address of the next `len` bytes of `to`, if they are contiguous in
+// its current segment, so a block may be decompressed right into them
+static unsigned char *zfile_iter_buf(struct iov_iter *to, size_t len) {
+    const struct bio_vec *bv;
+
+    if (iov_iter_is_kvec(to)) {
+        if (to->kvec->iov_len - to->iov_offset < len) return NULL;
+        return to->kvec->iov_base + to->iov_offset;
     }
+    if (iov_iter_is_bvec(to)) {
+        // multi-page bvecs are physically contiguous, lowmem maps them
+        // linearly
+        bv = to->bvec;
+        if (bv->bv_len - to->iov_offset < len || PageHighMem(bv->bv_page))
+            return NULL;
+        return page_address(bv->bv_page) + bv->bv_offset + to->iov_offset;
+    }
+    return NULL;
+}
 
-    c_buf = src_buf;
+// decompress blocks [from, to] missing in cache into cache entries. best
+// effort, blocks failed or evicted later are decompressed again by the reader
+static void zfile_decompress_range(struct zfile *zf, const unsigned char *src,
+                                   loff_t begin, size_t from, size_t to) {
+    struct zfile_cache_entry *ent;
+    size_t i;
+    int dc;
+
+    for (i = from; i <= to; i++) {
+        if (zfile_cache_contains(&zf->cache, i)) continue;
+        ent = zfile_cache_get(&zf->cache);
+        if (!ent) return;
+        dc = zfile_decompress_block(zf, src, begin, i, ent->data);
+        if (dc < 0) {
+            kfree(ent);
+            return;
+        }
+        zfile_cache_insert(&zf->cache, ent, i, dc);
+    }
+}
+
+static void zfile_job_work(struct work_struct *work) {
+    struct zfile_job *job = container_of(work, struct zfile_job, work);
+    unsigned int noio;
+
+    // `zfile_wq` workers run on behalf of block I/O too, allocations of
+    // cache entries and codec contexts must not recurse into it
+    noio = memalloc_noio_save();
+    zfile_decompress_range(job->zf, job->src, job->begin, job->from, job->to);
+    memalloc_noio_restore(noio);
+    if (atomic_dec_and_test(job->pending)) complete(job->done);
+}
+
+// fan decompression of window [from, to] out to `zfile_wq`, keeping the
+// first share for the calling thread, and wait for all of them. results go
+// to the block cache, from where the caller copies them out in order. work
+// items live in `scr`, which holds the window until they are all done
+static void zfile_decompress_parallel(struct zfile *zf,
+                                      struct zfile_scratch *scr,
+                                      const unsigned char *src, loff_t begin,
+                                      size_t from, size_t to) {
+    struct zfile_job *jobs = scr->jobs;
+    DECLARE_COMPLETION_ONSTACK(done);
+    atomic_t pending;
+    size_t nr = to - from + 1;
+    size_t nr_jobs, share, i;
+
+    nr_jobs = min3(nr, (size_t)num_online_cpus(), (size_t)ZF_PARALLEL_MAX);
+    share = DIV_ROUND_UP(nr, nr_jobs);
+    nr_jobs = DIV_ROUND_UP(nr, share);
+    atomic_set(&pending, nr_jobs - 1);
+    for (i = 1; i < nr_jobs; i++) {
+        jobs[i].zf = zf;
+        jobs[i].src = src;
+        jobs[i].begin = begin;
+        jobs[i].from = from + i * share;
+        jobs[i].to = min(to, jobs[i].from + share - 1);
+        jobs[i].pending = &pending;
+        jobs[i].done = &done;
+        INIT_WORK(&jobs[i].work, zfile_job_work);
+        queue_work(zfile_wq, &jobs[i].work);
+    }
+    zfile_decompress_range(zf, src, begin, from, min(to, from + share - 1));
+    if (nr_jobs > 1) wait_for_completion(&done);
+}
+
+void zfile_prefetch(struct zfile *zf, size_t count, loff_t offset) {
+    size_t bs = zf->header.opt.block_size;
+    struct zfile_scratch *scr;
+    const unsigned char *src;
+    size_t i, end_idx, win_end;
+    loff_t begin, range;
+
+    count = zfile_clamp(zf, count, offset);
+    if (count == 0 || zf->cache.max_entries < 2) return;
+    // never more than the cache keeps, or prefetch evicts itself
+    end_idx = min((offset + count - 1) / bs,
+                  offset / bs + zf->cache.max_entries / 2 - 1);
+    scr = zfile_scratch_tryget(zf);
+    if (!scr) return;
+    for (i = offset / bs; i <= end_idx; i = win_end + 1) {
+        win_end = i;
+        if (zfile_cache_contains(&zf->cache, i)) continue;
+        win_end = min(end_idx, i + zf->pool.window - 1);
+        if (zfile_jump_ensure(zf, i, win_end + 1)) break;
+        begin = zfile_block_offset(zf, i);
+        range = zfile_block_offset(zf, win_end + 1) - begin;
+        src = zfile_fetch(zf, scr, begin, range);
+        if (!src) break;
+        if (parallel_blocks && win_end - i + 1 >= parallel_blocks)
+            zfile_decompress_parallel(zf, scr, src, begin, i, win_end);
+        else
+            zfile_decompress_range(zf, src, begin, i, win_end);
+    }
+    zfile_unmap(scr);
+    zfile_scratch_put(zf, scr);
+}
+
+// decompress blocks covering extents `ext[0..n)` in turn into `to`.
+// extents are ascending in zfile and may share blocks at their edges.
+// blocks missing in cache are decompressed from `scr->cbuf`, which holds
+// compressed data read from back file at `begin`; if `scr` is NULL, a scratch
+// is taken from the pool and compressed data is fetched by `zfile_fetch`,
+// each fetch covering a window from the missing block up to `pool.window`
+// blocks towards the last block of all extents. either way, the first miss
+// in a window may fan the rest of it out by `zfile_decompress_parallel`,
+// mapped in place or not.
+static ssize_t zfile_read_blocks(struct zfile *zf, struct iov_iter *to,
+                                 const struct zfile_extent *ext, int n,
+                                 struct zfile_scratch *scr, loff_t begin) {
+    size_t end_idx, last_idx;
+    size_t win_begin = 0, win_end = SIZE_MAX;
+    loff_t range;
+    size_t bs;
+    ssize_t ret, cnt;
+    int dc = 0;
+    int e;
+    size_t i;
+    struct zfile_scratch *own = NULL;
+    const unsigned char *src = scr ? scr->cbuf : NULL;
+    size_t decomp_idx = SIZE_MAX;
+    int decomp_len = 0;
+    unsigned char *out;
+    struct zfile_cache_entry *ent;
+    loff_t offset, poff;
+    size_t count, pcnt;
+    bool fanout = scr != NULL;
+
+    if (!zf) {
+        pr_info("zfile: failed empty zf\n");
+        return -EIO;
+    }
+    bs = zf->header.opt.block_size;
+    // read empty
+    if (n == 0) return 0;
+    count = zfile_clamp(zf, ext[n - 1].count, ext[n - 1].offset);
+    last_idx = (ext[n - 1].offset + max_t(size_t, count, 1) - 1) / bs;
+    // window read by the caller covers blocks of all extents
+    if (scr) {
+        win_begin = ext[0].offset / bs;
+        win_end = last_idx;
+    }
 
-    // decompress in seq
-    decomp_offset = offset - offset % bs;
     ret = 0;
-    for (i = start_idx; i <= end_idx; i++) {
-        dc = LZ4_decompress_safe(
-            c_buf, decomp_buf,
-            zf->jump[i].delta - (zf->header.opt.verify ? sizeof(uint32_t) : 0),
-            bs);
-        if (dc <= 0) {
-            pr_info("decompress failed\n");
-            ret = -EIO;
-            goto fail_read;
+    for (e = 0; e < n; e++) {
+        offset = ext[e].offset;
+        count = zfile_clamp(zf, ext[e].count, offset);
+        if (count == 0) break;
+        end_idx = (offset + count - 1) / bs;
+        for (i = offset / bs; i <= end_idx; i++) {
+            poff = offset - i * bs;
+            pcnt = min_t(size_t, count, bs - poff);
+            ent = NULL;
+            // block shared with the previous extent, decompressed already
+            if (i == decomp_idx) {
+                out = scr->dbuf;
+                dc = decomp_len;
+                goto copy;
+            }
+            cnt = zfile_cache_read(&zf->cache, i, to, poff, pcnt);
+            if (cnt == -EFAULT) {
+                ret = cnt;
+                goto fail_read;
+            }
+            vbd_stat_add(&zf->stats,
+                         cnt >= 0 ? VBD_CACHE_HIT : VBD_CACHE_MISS, 1);
+            if (cnt >= 0) goto next;
+
+            if (!scr) {
+                scr = own = zfile_scratch_get(zf);
+                if (!scr) {
+                    ret = -ENOMEM;
+                    goto fail_read;
+                }
+            }
+            // miss out of fetched window, read compressed data from here
+            if (!src || i < win_begin || i > win_end) {
+                win_begin = i;
+                win_end = min(last_idx, i + zf->pool.window - 1);
+                if (zfile_jump_ensure(zf, win_begin, win_end + 1)) {
+                    ret = -EIO;
+                    goto fail_read;
+                }
+                begin = zfile_block_offset(zf, win_begin);
+                range = zfile_block_offset(zf, win_end + 1) - begin;
+                src = zfile_fetch(zf, scr, begin, range);
+                if (!src) {
+                    ret = -EIO;
+                    goto fail_read;
+                }
+                fanout = true;
+            }
+            // large window, decompress the rest of it into cache on several
+            // CPUs, unless it would evict its own blocks before they are read
+            if (fanout && parallel_blocks &&
+                win_end - i + 1 >= parallel_blocks &&
+                win_end - i + 1 <= zf->cache.max_entries / 2) {
+                fanout = false;
+                zfile_decompress_parallel(zf, scr, src, begin, i, win_end);
+                cnt = zfile_cache_read(&zf->cache, i, to, poff, pcnt);
+                if (cnt == -EFAULT) {
+                    ret = cnt;
+                    goto fail_read;
+                }
+                if (cnt >= 0) goto next;
+            }
+            fanout = false;
+
+            // whole block wanted, decompress it into the destination. it
+            // is not cached then, the page cache above keeps whole blocks
+            if (poff == 0 && pcnt == bs) {
+                out = zfile_iter_buf(to, bs);
+                if (out) {
+                    dc = zfile_decompress_block(zf, src, begin, i, out);
+                    if (dc < 0) {
+                        ret = dc;
+                        goto fail_read;
+                    }
+                    cnt = min_t(ssize_t, pcnt, dc);
+                    iov_iter_advance(to, cnt);
+                    goto next;
+                }
+            }
+
+            ent = zfile_cache_get(&zf->cache);
+            if (ent) {
+                out = ent->data;
+            } else {
+                out = scr->dbuf;
+                decomp_idx = i;
+            }
+            dc = zfile_decompress_block(zf, src, begin, i, out);
+            if (dc < 0) {
+                kfree(ent);
+                ret = dc;
+                goto fail_read;
+            }
+            if (!ent) decomp_len = dc;
+copy:
+            cnt = min_t(ssize_t, pcnt, dc - poff);
+            if (copy_to_iter(out + poff, cnt, to) != cnt) {
+                kfree(ent);
+                ret = -EFAULT;
+                goto fail_read;
+            }
+            if (ent) zfile_cache_insert(&zf->cache, ent, i, dc);
+next:
+            ret += cnt;
+            count -= cnt;
+            offset += cnt;
         }
-        poff = offset - decomp_offset;
-        pcnt = count > (dc - poff) ? (dc - poff) : count;
-        memcpy(dst, decomp_buf + poff, pcnt);
-        decomp_offset += dc;
-        dst += pcnt;
-        ret += pcnt;
-        count -= pcnt;
-        offset = decomp_offset;
-        c_buf += zf->jump[i].delta;
     }
 
 fail_read:
-    kfree(decomp_buf);
-    kfree(src_buf);
+    zfile_unmap(scr);
+    zfile_scratch_put(zf, own);
 
     return ret;
 }
 
-void build_jump_table(uint32_t *jt_saved, struct zfile *zf) {
+ssize_t zfile_decompress_iter(struct zfile *zf, struct iov_iter *to,
+                              size_t count, loff_t offset,
+                              struct zfile_scratch *scr, loff_t begin) {
+    struct zfile_extent ext = {.offset = offset, .count = count};
+
+    return zfile_read_blocks(zf, to, &ext, 1, scr, begin);
+}
+
+ssize_t zfile_read_extents(struct zfile *zf, struct iov_iter *to,
+                           const struct zfile_extent *ext, int n) {
+    return zfile_read_blocks(zf, to, ext, n, NULL, 0);
+}
+
+ssize_t zfile_read_iter(struct zfile *zf, struct iov_iter *to, size_t count,
+                        loff_t offset) {
+    struct zfile_extent ext = {.offset = offset, .count = count};
+
+    return zfile_read_extents(zf, to, &ext, 1);
+}
+
+ssize_t zfile_read(struct zfile *zf, void *dst, size_t count, loff_t offset) {
+    struct kvec kv = {.iov_base = dst, .iov_len = count};
+    struct iov_iter iter;
+
+    iov_iter_kvec(&iter, READ, &kv, 1, count);
+    return zfile_read_iter(zf, &iter, count, offset);
+}
+
+// a dictionary shared by all blocks is stored right after the header,
+// blocks follow it
+static size_t zfile_dict_size(struct zfile *zf) {
+    return zf->header.opt.use_dict ? zf->header.opt.dict_size : 0;
+}
+
+static int zfile_load_dict(struct zfile *zf) {
+    size_t size = zfile_dict_size(zf);
+    ssize_t ret;
+
+    if (size == 0) return 0;
+    if (size > ZF_DICT_MAX) {
+        pr_info("zfile: dictionary of %zu bytes too large\n", size);
+        return -EINVAL;
+    }
+    zf->dict = vmalloc(size);
+    if (!zf->dict) return -ENOMEM;
+    ret = file_read(zf->fp, zf->dict, size, ZF_SPACE);
+    if (ret != size) {
+        pr_info("zfile: failed to read dictionary, ret=%ld\n", ret);
+        return -EIO;
+    }
+    pr_info("zfile: loaded dictionary of %zu bytes\n", size);
+    return 0;
+}
+
+static void zfile_jump_free(struct jump_table *jt) {
     size_t i;
-    zf->jump = vmalloc((zf->header.index_size + 2) * sizeof(struct jump_table));
-    zf->jump[0].partial_offset = ZF_SPACE;
-    for (i = 0; i < zf->header.index_size; i++) {
-        zf->jump[i].delta = jt_saved[i];
-        zf->jump[i + 1].partial_offset =
-            zf->jump[i].partial_offset + jt_saved[i];
+
+    if (jt->flat) {
+        for (i = 0; i < jt->nr_pages; i++) kvfree(jt->flat[i]);
     }
+    vfree(jt->flat);
+    vfree(jt->partial_offset);
+    vfree(jt->deltas);
+    jt->flat = NULL;
+    jt->partial_offset = NULL;
+    jt->deltas = NULL;
 }
 
-void zfile_close(struct zfile *zfile) {
+static int zfile_jump_init(struct zfile *zf) {
+    struct jump_table *jt = &zf->jump;
+    size_t n = zf->header.index_size;
+
+    mutex_init(&jt->lock);
+    jt->nr_pages = n / ZF_JUMP_PAGE + 1;
+    jt->partial_offset = vmalloc(jt->nr_pages * ZF_JUMP_PAGE / ZF_JUMP_GROUP *
+                                 sizeof(uint64_t));
+    jt->deltas = vmalloc(jt->nr_pages * ZF_JUMP_PAGE * sizeof(uint16_t));
+    jt->flat = vzalloc(jt->nr_pages * sizeof(uint64_t *));
+    if (!jt->partial_offset || !jt->deltas || !jt->flat) return -ENOMEM;
+    jt->front = 0;
+    jt->front_end = ZF_SPACE + zfile_dict_size(zf);
+    return 0;
+}
+
+// blocks with a size in page `k`, the last page holds one entry more
+static size_t zfile_jump_page_blocks(struct zfile *zf, size_t k) {
+    return min_t(size_t, ZF_JUMP_PAGE,
+                 zf->header.index_size - k * ZF_JUMP_PAGE);
+}
+
+// read sizes of blocks in page `k` from the table on disk, returns their sum
+static int64_t zfile_jump_read_page(struct zfile *zf, size_t k,
+                                    uint32_t *sizes) {
+    size_t cnt = zfile_jump_page_blocks(zf, k);
+    int64_t sum = 0;
+    ssize_t ret;
+    size_t i;
+
+    if (cnt == 0) return 0;
+    ret = file_read(zf->fp, sizes, cnt * sizeof(uint32_t),
+                    zf->header.index_offset +
+                        k * ZF_JUMP_PAGE * sizeof(uint32_t));
+    if (ret != cnt * sizeof(uint32_t)) {
+        pr_info("zfile: failed to read jump table page %zu, ret=%ld\n", k,
+                ret);
+        return -EIO;
+    }
+    for (i = 0; i < cnt; i++) {
+        // scratch buffers were sized by a bound, not by actual sizes
+        if (zf->lazy && sizes[i] > zf->max_csize) {
+            pr_info("zfile: block %zu of %u bytes too large\n",
+                    k * ZF_JUMP_PAGE + i, sizes[i]);
+            return -EIO;
+        }
+        if (!zf->lazy) zf->max_csize = max(zf->max_csize, sizes[i]);
+        sum += sizes[i];
+    }
+    return sum;
+}
+
+// build page `k` of the table from block sizes, its first entry at `offset`
+static int zfile_jump_build_page(struct zfile *zf, size_t k,
+                                 const uint32_t *sizes, uint64_t offset) {
+    struct jump_table *jt = &zf->jump;
+    size_t cnt = zfile_jump_page_blocks(zf, k);
+    // entries of the page, the one past the last block included
+    size_t ent = min_t(size_t, ZF_JUMP_PAGE, cnt + (cnt < ZF_JUMP_PAGE));
+    size_t first = k * ZF_JUMP_PAGE;
+    uint64_t start = offset, excess;
+    uint64_t *flat;
+    size_t g, i, end;
+    uint32_t lo;
+
+    for (g = 0; g * ZF_JUMP_GROUP < ent; g++) {
+        end = min(ent, (g + 1) * ZF_JUMP_GROUP);
+        lo = g * ZF_JUMP_GROUP < cnt ? U16_MAX : 0;
+        for (i = g * ZF_JUMP_GROUP; i < min(cnt, end); i++)
+            lo = min(lo, sizes[i]);
+        jt->partial_offset[(first + g * ZF_JUMP_GROUP) / ZF_JUMP_GROUP] =
+            (offset << 16) | lo;
+        excess = 0;
+        for (i = g * ZF_JUMP_GROUP; i < end; i++) {
+            if (excess > U16_MAX) goto flat;
+            jt->deltas[first + i] = excess;
+            if (i == cnt) break;
+            excess += sizes[i] - lo;
+            offset += sizes[i];
+        }
+    }
+    return 0;
+
+flat:
+    flat = kvmalloc_array(ent, sizeof(uint64_t), GFP_NOIO);
+    if (!flat) return -ENOMEM;
+    flat[0] = start;
+    for (i = 1; i < ent; i++) flat[i] = flat[i - 1] + sizes[i - 1];
+    jt->flat[k] = flat;
+    return 0;
+}
+
+// build page `front`, with `jt->lock` held
+static int zfile_jump_load(struct zfile *zf) {
+    struct jump_table *jt = &zf->jump;
+    size_t k = jt->front;
+    uint32_t *sizes;
+    int64_t sum;
+    int ret;
+
+    sizes = kmalloc_array(ZF_JUMP_PAGE, sizeof(uint32_t), GFP_NOIO);
+    if (!sizes) return -ENOMEM;
+    sum = zfile_jump_read_page(zf, k, sizes);
+    ret = sum < 0 ? sum : 0;
+    if (ret) goto out;
+    // blocks end where the table is stored, or sizes are corrupt
+    if (k + 1 == jt->nr_pages &&
+        jt->front_end + sum != zf->header.index_offset) {
+        pr_info("zfile: jump table ends at %llu, not at index %llu\n",
+                jt->front_end + sum, zf->header.index_offset);
+        ret = -EIO;
+        goto out;
+    }
+    ret = zfile_jump_build_page(zf, k, sizes, jt->front_end);
+    if (ret) goto out;
+    jt->front_end += sum;
+    // page contents visible before it is taken as built
+    smp_store_release(&jt->front, k + 1);
+out:
+    kfree(sizes);
+    return ret;
+}
+
+// build pages of the table up to the one holding entry `last`. offsets of
+// a page follow from all sizes before it, so pages are built in order
+static int zfile_jump_ensure(struct zfile *zf, size_t first, size_t last) {
+    struct jump_table *jt = &zf->jump;
+    size_t k = last / ZF_JUMP_PAGE;
+    int ret = 0;
+
+    if (k < smp_load_acquire(&jt->front)) return 0;
+    mutex_lock(&jt->lock);
+    while (!ret && k >= jt->front) ret = zfile_jump_load(zf);
+    mutex_unlock(&jt->lock);
+    return ret;
+}
+
+// build the whole table, as eager open does
+int zfile_warm(struct zfile *zf) {
+    struct jump_table *jt = &zf->jump;
+    int ret = 0;
+
+    mutex_lock(&jt->lock);
+    while (!ret && jt->front < jt->nr_pages) ret = zfile_jump_load(zf);
+    mutex_unlock(&jt->lock);
+    return ret;
+}
+
+static void zfile_free(struct zfile *zfile) {
     pr_info("zfile: close\n");
     if (zfile) {
-        if (zfile->jump) {
-            vfree(zfile->jump);
-            zfile->jump = NULL;
-        }
+        zfile_jump_free(&zfile->jump);
+        zfile_cache_destroy(&zfile->cache);
+        zfile_pool_destroy(&zfile->pool);
+        if (zfile->codec && zfile->codec->exit)
+            zfile->codec->exit(zfile->codec_ctx);
+        lcache_close(zfile->lcache);
+        vfree(zfile->dict);
+        vfree(zfile->verified);
+        vbd_stats_destroy(&zfile->stats);
         if (zfile->fp) {
             file_close(zfile->fp);
             zfile->fp = NULL;
@@ -188,13 +1326,50 @@ void zfile_close(struct zfile *zfile) {
     }
 }
 
+// called with `zfile_layers_lock` held by `kref_put_mutex`
+static void zfile_release(struct kref *ref) {
+    struct zfile *zf = container_of(ref, struct zfile, ref);
+
+    list_del(&zf->layer);
+    mutex_unlock(&zfile_layers_lock);
+    zfile_free(zf);
+}
+
+void zfile_close(struct zfile *zfile) {
+    if (zfile) kref_put_mutex(&zfile->ref, zfile_release, &zfile_layers_lock);
+}
+
+static int zfile_read_trailer(struct file *file, struct zfile_ht *ht) {
+    ssize_t ret;
+
+    ret = file_read(file, ht, sizeof(struct zfile_ht),
+                    file_len(file) - ZF_SPACE);
+    return ret == sizeof(struct zfile_ht) ? 0 : -EIO;
+}
+
+// opened zfile of the same layer as `file`, by inode and trailer, with a
+// reference taken. `zfile_layers_lock` held
+static struct zfile *zfile_find_layer(struct file *file,
+                                      const struct zfile_ht *ht) {
+    struct inode *inode = file_inode(file), *other;
+    struct zfile *zf;
+
+    list_for_each_entry(zf, &zfile_layers, layer) {
+        other = file_inode(zf->fp);
+        if (other->i_sb->s_dev == inode->i_sb->s_dev &&
+            other->i_ino == inode->i_ino &&
+            !memcmp(&zf->header, ht, sizeof(struct zfile_ht))) {
+            kref_get(&zf->ref);
+            return zf;
+        }
+    }
+    return NULL;
+}
+
 struct zfile *zfile_open_by_file(struct file *file) {
-    uint32_t *jt_saved;
     size_t jt_size = 0;
     struct zfile *zfile = NULL;
-    int ret = 0;
     size_t file_size = 0;
-    loff_t tailer_offset;
 
     if (!is_zfile(file)) return NULL;
 
@@ -204,14 +1379,14 @@ struct zfile *zfile_open_by_file(struct file *file) {
     }
 
     zfile->fp = file;
+    kref_init(&zfile->ref);
+    INIT_LIST_HEAD(&zfile->layer);
 
     // should verify header
 
     file_size = file_len(zfile->fp);
-    tailer_offset = file_size - ZF_SPACE;
     pr_info("zfile: file_size=%lu\n", file_size);
-    ret = file_read(zfile->fp, &zfile->header, sizeof(struct zfile_ht),
-                    tailer_offset);
+    if (zfile_read_trailer(zfile->fp, &zfile->header)) goto fail_open;
 
     pr_info(
         "zfile: Tailer vsize=%lld index_offset=%lld index_size=%lld "
@@ -222,6 +1397,23 @@ struct zfile *zfile_open_by_file(struct file *file) {
     pr_info("zfile: vlen=%lld size=%ld\n", zfile->header.vsize,
             zfile_len(zfile));
 
+    zfile->codec = zfile_codec_find(zfile->header.opt.type);
+    if (!zfile->codec) {
+        pr_info("zfile: unsupported compression type %d\n",
+                zfile->header.opt.type);
+        goto fail_open;
+    }
+    if (zfile_load_dict(zfile)) goto fail_open;
+    if (zfile->codec->init &&
+        zfile->codec->init(&zfile->codec_ctx, zfile->dict,
+                           zfile->header.opt.dict_size)) {
+        pr_info("zfile: failed to init %s\n", zfile->codec->name);
+        zfile->codec = NULL;
+        goto fail_open;
+    }
+    pr_info("zfile: codec %s level %d\n", zfile->codec->name,
+            zfile->header.opt.level);
+
     jt_size = ((uint64_t)zfile->header.index_size) * sizeof(uint32_t);
     printk("get index_size %lu, index_offset %llu", jt_size,
            zfile->header.index_offset);
@@ -230,36 +1422,93 @@ struct zfile *zfile_open_by_file(struct file *file) {
         goto fail_open;
     }
 
-    jt_saved = vmalloc(jt_size);
-
-    ret = file_read(zfile->fp, jt_saved, jt_size, zfile->header.index_offset);
+    if (zfile_jump_init(zfile)) goto fail_open;
+    zfile->lazy = lazy_jump;
+    if (zfile->lazy) {
+        // unknown until all sizes are read, take what the codec may take
+        zfile->max_csize = zfile->header.opt.block_size +
+                           zfile->header.opt.block_size / 128 + 64 +
+                           (zfile->header.opt.verify ? sizeof(uint32_t) : 0);
+    } else if (zfile_warm(zfile)) {
+        goto fail_open;
+    }
 
-    build_jump_table(jt_saved, zfile);
+    if (zfile->header.opt.verify) {
+        zfile->verified = vzalloc(BITS_TO_LONGS(zfile->header.index_size) *
+                                  sizeof(unsigned long));
+        if (!zfile->verified) goto fail_open;
+    }
+    zfile->verify_mode = ZF_VERIFY_ALWAYS;
 
-    vfree(jt_saved);
+    if (zfile_cache_init(&zfile->cache, zfile->header.opt.block_size,
+                         ((size_t)cache_mb << 20) /
+                             zfile->header.opt.block_size)) {
+        pr_info("zfile: failed to init block cache\n");
+        goto fail_open;
+    }
+    if (zfile_pool_init(zfile)) {
+        pr_info("zfile: failed to init scratch buffers\n");
+        goto fail_open;
+    }
+    if (vbd_stats_init(&zfile->stats)) goto fail_open;
 
     return zfile;
 
 fail_open:
+    // `file` stays with the caller
+    zfile->fp = NULL;
     zfile_close(zfile);
 fail_alloc:
     return NULL;
 }
 
+int zfile_init(void) {
+    zfile_wq = alloc_workqueue("zfile", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+    return zfile_wq ? 0 : -ENOMEM;
+}
+
+void zfile_exit(void) { destroy_workqueue(zfile_wq); }
+
 struct zfile *zfile_open(const char *path) {
-    struct zfile *ret = NULL;
+    struct zfile *ret = NULL, *other;
     struct file *file = file_open(path, 0, 644);
+    struct zfile_ht ht;
+
     if (!file) {
         pr_info("zfile: Canot open zfile %s\n", path);
         return NULL;
     }
+    if (is_zfile(file) && !zfile_read_trailer(file, &ht)) {
+        mutex_lock(&zfile_layers_lock);
+        ret = zfile_find_layer(file, &ht);
+        mutex_unlock(&zfile_layers_lock);
+        if (ret) {
+            pr_info("zfile: %s shares an opened layer\n", path);
+            file_close(file);
+            return ret;
+        }
+    }
     ret = zfile_open_by_file(file);
     if (!ret) {
         file_close(file);
+        return NULL;
+    }
+    // opened by someone else meanwhile, keep theirs
+    mutex_lock(&zfile_layers_lock);
+    other = zfile_find_layer(file, &ret->header);
+    if (!other) list_add(&ret->layer, &zfile_layers);
+    mutex_unlock(&zfile_layers_lock);
+    if (other) {
+        zfile_close(ret);
+        ret = other;
     }
     return ret;
 }
 
+void zfile_set_lcache(struct zfile *zf, struct lcache *lc) {
+    zf->lcache = lc;
+}
+
 struct file *zfile_getfile(struct zfile *zfile) {
     return zfile->fp;
 }
@@ -279,3 +1528,104 @@ bool is_zfile(struct file *file) {
 
     return ht.magic0 == *MAGIC0 && uuid_equal(&ht.magic1, &MAGIC1);
 }
+
+// compressors are only needed by the benchmark, which skips codecs whose
+// compressor is not built
+static int zfile_bench_compress(uint8_t type, const unsigned char *src,
+                                size_t len, unsigned char *dst, size_t cap) {
+    int ret = -EOPNOTSUPP;
+
+    switch (type) {
+#if IS_REACHABLE(CONFIG_LZ4_COMPRESS)
+        case ZF_CODEC_LZ4: {
+            void *ws = vmalloc(LZ4_MEM_COMPRESS);
+
+            if (!ws) return -ENOMEM;
+            ret = LZ4_compress_default(src, dst, len, cap, ws);
+            if (ret <= 0) ret = -EIO;
+            vfree(ws);
+            break;
+        }
+#endif
+#if IS_REACHABLE(CONFIG_ZSTD_COMPRESS)
+        case ZF_CODEC_ZSTD: {
+            ZSTD_parameters params = ZSTD_getParams(3, len, 0);
+            size_t size = ZSTD_CCtxWorkspaceBound(params.cParams);
+            ZSTD_CCtx *cctx;
+            size_t zret;
+            void *ws;
+
+            ws = vmalloc(size);
+            if (!ws) return -ENOMEM;
+            cctx = ZSTD_initCCtx(ws, size);
+            zret = cctx ? ZSTD_compressCCtx(cctx, dst, cap, src, len, params)
+                        : (size_t)-1;
+            ret = ZSTD_isError(zret) ? -EIO : zret;
+            vfree(ws);
+            break;
+        }
+#endif
+        default:
+            break;
+    }
+    return ret;
+}
+
+void zfile_codec_bench(size_t block_size, size_t blocks) {
+    const size_t cap = block_size * 2;
+    unsigned char *src, *comp, *out;
+    uint32_t *clen;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    uint64_t t0, ns, csize;
+    void *ctx = NULL;
+    size_t i, j;
+    int type, ret;
+
+    src = vmalloc(block_size * blocks);
+    comp = vmalloc(cap * blocks);
+    out = vmalloc(block_size);
+    clen = vmalloc(blocks * sizeof(uint32_t));
+    if (!src || !comp || !out || !clen) goto out;
+    // runs of bytes from a small alphabet, roughly 2:1 for lz4
+    for (i = 0; i < block_size * blocks; i += j) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        for (j = 0; j < 1 + seed % 16 && i + j < block_size * blocks; j++)
+            src[i + j] = 'a' + (seed >> 8) % (j == 0 ? 26 : 4);
+    }
+
+    for (type = 0; type < ARRAY_SIZE(zfile_codecs); type++) {
+        const struct zfile_codec *codec = zfile_codec_find(type);
+
+        if (!codec) continue;
+        csize = 0;
+        for (i = 0; i < blocks; i++) {
+            ret = zfile_bench_compress(type, src + i * block_size, block_size,
+                                       comp + i * cap, cap);
+            if (ret < 0) break;
+            clen[i] = ret;
+            csize += ret;
+        }
+        if (i < blocks) {
+            pr_info("zfile: bench %s skipped, cannot compress (%d)\n",
+                    codec->name, ret);
+            continue;
+        }
+        if (codec->init && codec->init(&ctx, NULL, 0)) continue;
+        t0 = ktime_get_ns();
+        for (i = 0; i < blocks; i++)
+            codec->decompress(ctx, comp + i * cap, clen[i], out, block_size);
+        ns = max_t(uint64_t, ktime_get_ns() - t0, 1);
+        if (codec->exit) codec->exit(ctx);
+        ctx = NULL;
+        pr_info("zfile: bench %s block=%zu ratio=%llu%% decompress=%llu MB/s\n",
+                codec->name, block_size, csize * 100 / (block_size * blocks),
+                (uint64_t)block_size * blocks * 1000 / ns);
+    }
+out:
+    vfree(clen);
+    vfree(out);
+    vfree(comp);
+    vfree(src);
+}
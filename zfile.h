@@ -2,9 +2,16 @@
 #define __ZFILE_RO_H__
 
 #include <linux/blk-mq.h>
+#include <linux/kref.h>
 #include <linux/kthread.h>
+#include <linux/mutex.h>
 #include <linux/uuid.h>
 
+#include "stats.h"
+
+struct lcache;
+struct zfile_job;
+
 struct compress_options {
     uint32_t block_size;  // 4
     uint8_t type;         // 5
@@ -43,17 +50,137 @@ struct zfile_ht {
 
 _Static_assert(96 == sizeof(struct zfile_ht), "Header size not fit");
 
+#define ZF_JUMP_GROUP 16
+// blocks whose sizes take one 4 KiB page of the table on disk
+#define ZF_JUMP_PAGE 1024
+
+// back file offsets of compressed blocks, in two levels. each group of
+// `ZF_JUMP_GROUP` blocks has a `partial_offset`: 48 bits offset of its
+// first block + 16 bits partial minimum, the least compressed size in the
+// group. block `i` is at `(i % ZF_JUMP_GROUP) * minimum + deltas[i]` from
+// there, `deltas` adding up what blocks before it in the group exceed the
+// minimum by. there is an entry past the last block, so block size is
+// the difference to the next one.
+//
+// the table is built in pages of `ZF_JUMP_PAGE` entries, a page with a
+// group overflowing 16 bits is kept as plain offsets in `flat` instead.
+// pages [0, front) are built, from the first block on. see
+// `zfile_jump_ensure`
 struct jump_table {
-    uint64_t
-        partial_offset;  // 48 bits logical offset + 16 bits partial minimum
-    uint16_t delta;
+    uint64_t* partial_offset;
+    uint16_t* deltas;
+    uint64_t** flat;
+    size_t nr_pages;
+    size_t front;
+    uint64_t front_end;  // offset of the first entry of page `front`
+    struct mutex lock;   // serializes building pages
+};
+
+// decompressed block, keyed by block index. held by the cache while in it,
+// and by each reader copying out of it, the last one frees it
+struct zfile_cache_entry {
+    struct hlist_node node;
+    struct list_head lru;
+    size_t idx;
+    int len;
+    atomic_t ref;
+    unsigned long touched;  // `clock` when last put at the LRU head
+    unsigned char data[];
+};
+
+// bounded LRU cache of decompressed blocks, so that sub-block and repeated
+// reads are served by memcpy instead of backing read + decompress. `lock`
+// covers lookups and the LRU only, data is copied out with it dropped
+struct zfile_cache {
+    spinlock_t lock;
+    struct hlist_head* buckets;
+    unsigned int hash_bits;
+    struct list_head lru;  // most recently used at head
+    unsigned long clock;   // entries put at the LRU head so far
+    size_t nr_entries;
+    size_t max_entries;
+    size_t entry_size;
+};
+
+// per-read working memory, taken from `struct zfile_pool`
+struct zfile_scratch {
+    struct list_head list;
+    unsigned char* cbuf;  // compressed data of a fetch window, vmalloc'ed
+    unsigned char* dbuf;  // one decompressed block
+    // whole chunks of local cache fetched for part of them, `cbuf` sized.
+    // allocated by the first fetch through local cache, kept from then on
+    unsigned char* bounce;
+    // back file pages of a fetch window read in place, mapped at `vaddr`
+    struct page** pages;
+    unsigned int nr_pages;
+    unsigned int max_pages;
+    void* vaddr;
+    // work items of `zfile_decompress_parallel`, `ZF_PARALLEL_MAX` of them
+    struct zfile_job* jobs;
 };
 
+// scratch buffers sized at open from block size and the largest compressed
+// block. up to `max` buffers are kept until the zfile is closed, so a
+// steady-state read allocates nothing; more are freed once put back
+struct zfile_pool {
+    spinlock_t lock;
+    struct list_head free;
+    unsigned int nr;
+    unsigned int max;
+    size_t window;      // blocks fetched by one back file read at most
+    size_t cbuf_size;
+};
+
+// a range of zfile to read, see `zfile_read_extents`
+struct zfile_extent {
+    loff_t offset;
+    size_t count;
+};
+
+// values of `compress_options.type`, as written by existing images
+#define ZF_CODEC_LZ4 1
+#define ZF_CODEC_ZSTD 2
+
+// decompressor of a `compress_options.type`, chosen at open. `init` gets
+// the shared dictionary of the zfile, or NULL; `decompress` returns
+// decompressed length, or <= 0 on error
+struct zfile_codec {
+    const char* name;
+    int (*init)(void** ctx, const void* dict, size_t dict_size);
+    void (*exit)(void* ctx);
+    int (*decompress)(void* ctx, const unsigned char* src, size_t len,
+                      unsigned char* dst, size_t cap);
+};
+
+// how blocks are checked against their trailing crc32c if `opt.verify`
+#define ZF_VERIFY_OFF 0
+#define ZF_VERIFY_ALWAYS 1
+#define ZF_VERIFY_FIRST 2  // once per block, tracked by `verified` bitmap
+#define ZF_VERIFY_MODES 3
+
 // zfile can be treated as file with extends
 struct zfile {
     struct file* fp;
     struct zfile_ht header;
-    struct jump_table* jump;
+    struct jump_table jump;
+    bool lazy;  // jump table pages are built when first used
+    uint32_t max_csize;
+    const struct zfile_codec* codec;
+    void* codec_ctx;
+    void* dict;  // `opt.dict_size` bytes if `opt.use_dict`, for all blocks
+    // strictest mode of devices on the layer, which share decompressed
+    // blocks. `verify_users` counts devices by mode, under the layers lock
+    int verify_mode;
+    unsigned int verify_users[ZF_VERIFY_MODES];
+    unsigned long* verified;  // a bit per block passed, if `opt.verify`
+    struct lcache* lcache;    // local cache of `fp`, may be NULL
+    struct zfile_cache cache;
+    struct zfile_pool pool;
+    // of the layer, shared by devices on it
+    struct vbd_stats stats;
+    // opened by path, the zfile is shared by all opening the same layer
+    struct kref ref;
+    struct list_head layer;
 };
 
 // zfile functions
@@ -62,6 +189,8 @@ struct zfile {
 // more-than-one page fetch, here is the place to caching non-complete used
 // compressed pages.
 //
+// returns the zfile already opened for the same layer if there is one, each
+// `zfile_open` is paired with a `zfile_close`
 struct zfile* zfile_open(const char* path);
 
 struct zfile* zfile_open_by_file(struct file* file);
@@ -70,10 +199,58 @@ bool is_zfile(struct file* file);
 
 ssize_t zfile_read(struct zfile* zfile, void* buff, size_t count,
                    loff_t offset);
+ssize_t zfile_read_iter(struct zfile* zfile, struct iov_iter* to, size_t count,
+                        loff_t offset);
+// read ascending extents one after another into `to`, fetching their
+// compressed data by one back file read and decompressing shared blocks once
+ssize_t zfile_read_extents(struct zfile* zfile, struct iov_iter* to,
+                           const struct zfile_extent* ext, int n);
+
+// for callers doing their own (async) read of compressed data:
+// `zfile_range` gives the back file range holding [offset, offset + count),
+// `zfile_decompress_iter` decompresses it from `scr->cbuf` read at `begin`,
+// and `zfile_cached` tells if no back file read is needed at all
+int zfile_range(struct zfile* zfile, size_t count, loff_t offset,
+                loff_t* begin, loff_t* range);
+ssize_t zfile_decompress_iter(struct zfile* zfile, struct iov_iter* to,
+                              size_t count, loff_t offset,
+                              struct zfile_scratch* scr, loff_t begin);
+bool zfile_cached(struct zfile* zfile, size_t count, loff_t offset);
+// copy [offset, offset + count) out of the block cache, without sleeping.
+// -EAGAIN at the first block not in cache, `to` is advanced over the blocks
+// copied before it. blocks copied are added to `*hits` instead of being
+// counted, for the caller to count once it serves the whole read
+ssize_t zfile_read_cached(struct zfile* zfile, struct iov_iter* to,
+                          size_t count, loff_t offset, size_t* hits);
+// fetch and decompress blocks covering [offset, offset + count) into the
+// block cache ahead of reads. best effort, gives up if no scratch is free
+void zfile_prefetch(struct zfile* zfile, size_t count, loff_t offset);
+// scratch buffers for such callers, `cbuf` holds `zfile_scratch_size` bytes.
+// `zfile_scratch_tryget` fails instead of going beyond the pool max
+struct zfile_scratch* zfile_scratch_get(struct zfile* zfile);
+struct zfile_scratch* zfile_scratch_tryget(struct zfile* zfile);
+void zfile_scratch_put(struct zfile* zfile, struct zfile_scratch* scr);
+size_t zfile_scratch_size(struct zfile* zfile);
 size_t zfile_len(struct zfile* zfile);
+// build all of a lazily loaded jump table
+int zfile_warm(struct zfile* zfile);
+// a device on `zfile` asks for `ZF_VERIFY_*` until it puts the mode back.
+// the layer verifies in the strictest mode asked for, or
+// `ZF_VERIFY_ALWAYS` if none
+void zfile_get_verify(struct zfile* zfile, int mode);
+void zfile_put_verify(struct zfile* zfile, int mode);
+// module wide setup, before any zfile is opened
+int zfile_init(void);
+void zfile_exit(void);
 void zfile_close(struct zfile* zfile);
 struct path zfile_getpath(struct zfile* zfile);
 
 struct file* zfile_getfile(struct zfile* zfile);
+// read compressed data through local cache `lc`, owned by zfile from now
+void zfile_set_lcache(struct zfile* zfile, struct lcache* lc);
+
+// microbenchmark of decompression, MB/s of each codec over `blocks`
+// synthetic blocks, reported by pr_info
+void zfile_codec_bench(size_t block_size, size_t blocks);
 
 #endif
\ No newline at end of file